@@ -0,0 +1,114 @@
+/**
+  ******************************************************************************
+  * @file    CBBL_usart/src/agent.c
+  * @author  Marco Zavatta, Yin Zhining
+  * @version V1.0
+  * @date    03/04/2012
+  * @brief   In-application update agent
+  ******************************************************************************
+  */
+
+#include "agent.h"
+
+#ifndef DUALSLOT
+#error "the update agent needs the dual slot memory map (DUALSLOT, hil.h)"
+#endif
+
+/** @addtogroup CBBL
+  * @{
+  */
+
+/* Transport the agent serves, and whether its RX interrupt feeds the session. */
+uint8_t agent_transport;
+uint8_t agent_irq;
+
+/*
+ * @brief  Starts the agent on a transport, confining the FLASH commands to the
+ *         inactive slot
+ * @param  transport (CAL_USART, CAL_CAN), 1 if the application routes the
+ *         transport's RX interrupt to agent_rxisr(), 0 if agent_poll() polls it
+ * @retval 0 if successful
+ * 		  -1 if the transport is not built in, or CAN did not come up
+ */
+int32_t agent_init(uint8_t transport, uint8_t irq) {
+	uint32_t base = slot_inactivebase();
+
+	/* Timebase first: CANinit() bounds its waits with it. */
+	hil_timeinit();
+	switch (transport) {
+		#ifdef USART
+		case CAL_USART :
+			USARTinit();
+			break;
+		#endif
+		#ifdef CAN
+		case CAL_CAN :
+			if (CANinit() == -1) return -1;
+			break;
+		#endif
+		default :
+			return -1;
+	}
+
+	hil_setflashrange(base, base + SLOTSIZE - 1);
+	hil_FPECenable();
+	hil_bkpinit();
+
+	agent_transport = transport;
+	agent_irq = irq;
+	command_sessioninit(command_getsession(transport), transport);
+	if (irq) cal_enableinterrupt(transport);
+	return 0;
+}
+
+/*
+ * @brief  Serves the session a step at a time; the host may take as long as it
+ *         likes to send the init byte
+ * @param  void
+ * @retval 1 once an activation is pending, see agent_handoff()
+ * 		   0 otherwise
+ */
+int32_t agent_poll(void) {
+	session_t *s = command_getsession(agent_transport);
+
+	if (agent_irq) command_process(s);
+	else command_poll(s);
+	return agent_pending();
+}
+
+/*
+ * @brief  To be called by the RX interrupt handler of the transport
+ * @param  void
+ * @retval void
+ */
+void agent_rxisr(void) {
+	command_rxisr(agent_transport);
+}
+
+/*
+ * @brief  Checks whether the host activated the slot written
+ * @param  void
+ * @retval 1 if an activation is pending
+ * 		   0 if not
+ */
+int32_t agent_pending(void) {
+	return (hil_readbkp(HIL_BKP_REQUEST) & SLOT_REQUEST_MASK) == SLOT_REQUEST;
+}
+
+/*
+ * @brief  Hands off to the bootloader for the final verify and activate, which
+ *         boots the new slot straight away (see hil_requestboot())
+ * @param  void
+ * @retval none, the device resets
+ */
+void agent_handoff(void) {
+	if (agent_irq) cal_disableinterrupt(agent_transport);
+	command_flush();
+	hil_requestboot();
+}
+
+/**
+  * @}
+  */
+
+/**************************** Politecnico di Milano ************END OF FILE****/
@@ -0,0 +1,47 @@
+/**
+  ******************************************************************************
+  * @file    CBBL_usart/src/agent.h
+  * @author  Marco Zavatta, Yin Zhining
+  * @version V1.0
+  * @date    03/04/2012
+  * @brief   In-application update agent
+  ******************************************************************************
+  */
+
+#include "includes.h"
+#include "cal.h"
+#include "hil.h"
+#include "commands.h"
+#include "slot.h"
+
+#ifndef AGENT_H
+#define AGENT_H
+
+/*
+ * The update agent is the bootloader's session layer built for an application
+ * (make agent in src: libcbblagent.a, everything compiled with CBBL_AGENT), so
+ * that an application running from one slot receives a new image into the
+ * other one while it keeps running. It serves the same protocol, except for
+ * the commands leaving the application or resetting the device (go, protect
+ * and unprotect, option bytes, batch jump); writes and erases are confined to
+ * the inactive slot and RAM is not accessible.
+ *
+ * The application gives the agent its transport (no other driver on USART1 or
+ * CAN1) and either routes the transport's RX interrupt to agent_rxisr() or
+ * lets agent_poll() poll it, calling agent_poll() from a low priority thread in
+ * both cases. Once the host activates the slot, agent_poll() returns 1: the
+ * application shuts down and calls agent_handoff(), the bootloader verifies the
+ * image again, activates it and boots it straight away, with no listen window.
+ * Only PA9/PA10 (USART1) or PB8/PB9 (CAN1) are configured.
+ * Note that the F1 FLASH stalls code fetches while it is programmed or erased.
+ * Requires DUALSLOT, in hil.h.
+ */
+
+/* Exported functions ------------------------------------------------------- */
+int32_t agent_init(uint8_t transport, uint8_t irq);
+int32_t agent_poll(void);
+void agent_rxisr(void);
+int32_t agent_pending(void);
+void agent_handoff(void);
+
+#endif /* AGENT_H */
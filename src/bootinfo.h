@@ -0,0 +1,44 @@
+/**
+  ******************************************************************************
+  * @file    CBBL_usart/src/bootinfo.h
+  * @author  Marco Zavatta, Yin Zhining
+  * @version V1.0
+  * @date    03/04/2012
+  * @brief   Boot information handed to the application
+  ******************************************************************************
+  */
+
+#include <stdint.h>
+
+#ifndef BOOTINFO_H
+#define BOOTINFO_H
+
+/*
+ * Before jumping to an application the bootloader leaves this record at the
+ * start of the RAM (BOOTINFObase, the .bootinfo section of the linker scripts).
+ * The application either keeps sizeof(bootinfo_t) bytes out of its own RAM
+ * region or reads the record before its startup code initializes the RAM.
+ * This header is all an application needs.
+ */
+
+#define BOOTINFObase			(0x20000000)
+#define BOOTINFO_MAGIC			(0x43424249)	/* "CBBI" */
+
+#define BOOTINFO				((const bootinfo_t *)BOOTINFObase)
+
+/* No slot validated, see bootinfo_t. */
+#define BOOTINFO_NOSLOT			(0xFF)
+
+typedef struct {
+	uint32_t magic;					/* BOOTINFO_MAGIC, written last */
+	uint8_t version;				/* bootloader version (BLVERSION) */
+	uint8_t resetcause;				/* RCC_CSR[31:24] at reset: reset flags */
+	uint8_t slot;					/* slot booted, BOOTINFO_NOSLOT if its image was not validated */
+	uint8_t reserved;
+	uint32_t appbase;				/* address jumped to */
+	uint32_t length;				/* validated image length, 0 if not validated */
+	uint32_t crc;					/* validated image CRC-32 */
+	uint32_t bootcycles;			/* core cycles from reset to the jump */
+} bootinfo_t;
+
+#endif /* BOOTINFO_H */
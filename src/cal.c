@@ -14,31 +14,144 @@
   * @{
   */
 
+/* Link counters, indexed by transport identifier - 1, see cal_getstats(). */
+calstats_t cal_stats[CAL_TRANSPORTS];
+
+#ifdef CAN
+/* CAN bus-off state when last looked at, to count the entries. */
+uint8_t cal_canbusoff;
+
+/* Set once cal_init() brought bxCAN up, see cal_available(). */
+uint8_t cal_canready;
+#endif
+
+/*
+ * @brief  Send byte through the given transport, counting it
+ * @param  Transport (CAL_USART, CAL_CAN), byte to be sent
+ * @retval 0 if successful, -1 if not successful
+ */
+int32_t cal_sendbyte(uint8_t t, uint8_t b) {
+	if (t == 0 || t > CAL_TRANSPORTS || cal_txbyte(t, b) == -1) return -1;
+	cal_stats[t-1].txbytes++;
+	cal_stats[t-1].txframes++;
+	#ifdef CAN
+	if (t == CAL_CAN) cal_canerrors();
+	#endif
+	return 0;
+}
+
+/*
+ * @brief  Fetch a byte from the given transport if one is waiting, never blocks,
+ *         counting it along with the receive errors of the transport.
+ *         This is what the command state machine is fed from.
+ * @param  Transport (CAL_USART, CAL_CAN), pointer to received byte container
+ * @retval 0 if a byte was fetched, -1 if nothing was pending
+ */
+int32_t cal_pollbyte(uint8_t t, uint8_t *c) {
+	uint16_t sr = 0;
+
+	if (t == 0 || t > CAL_TRANSPORTS) return -1;
+
+	#ifdef USART
+	/* The error flags go with the byte and are cleared by reading it. */
+	if (t == CAL_USART) {
+		sr = USART1->SR;
+		if (!(sr & USART_SR_RXNE)) return -1;
+	}
+	#endif
+	#ifdef CAN
+	if (t == CAL_CAN) cal_canerrors();
+	#endif
+
+	if (cal_rxbyte(t, c) == -1) return -1;
+	cal_stats[t-1].rxbytes++;
+	cal_stats[t-1].rxframes++;
+	if (sr & USART_SR_ORE) cal_stats[t-1].overruns++;
+	if (sr & USART_SR_FE) cal_stats[t-1].framing++;
+	if (sr & USART_SR_NE) cal_stats[t-1].noise++;
+	return 0;
+}
+
+#ifdef CAN
+/*
+ * @brief  Counts the CAN bus-off entries and the messages lost to FIFO 0 overruns
+ * @param  void
+ * @retval void
+ */
+void cal_canerrors(void) {
+	uint32_t esr = CAN1->ESR;
+
+	if ((esr & CAN_ESR_BOFF) && !cal_canbusoff) cal_stats[CAL_CAN-1].busoff++;
+	cal_canbusoff = (esr & CAN_ESR_BOFF) != 0;
+
+	if (CAN1->RF0R & CAN_RF0R_FOVR0) {
+		cal_stats[CAL_CAN-1].lost++;
+		CAN1->RF0R = CAN_RF0R_FOVR0;
+	}
+
+	/* Visual signal if any error has occurred. */
+	if (esr & CAN_ESR_REC)
+		GPIOA->BSRR |= GPIO_BSRR_BR0 | GPIO_BSRR_BR1 | GPIO_BSRR_BR2 | GPIO_BSRR_BR3;
+}
+#endif
+
+/*
+ * @brief  Link counters of a transport, the CAN error counters read as they are now
+ * @param  Transport (CAL_USART, CAL_CAN)
+ * @retval the counters, 0 if no such transport
+ */
+calstats_t *cal_getstats(uint8_t t) {
+	if (t == 0 || t > CAL_TRANSPORTS) return 0;
+	#ifdef CAN
+	if (t == CAL_CAN) {
+		cal_canerrors();
+		cal_stats[t-1].tec = (CAN1->ESR & CAN_ESR_TEC) >> 16;
+		cal_stats[t-1].rec = (CAN1->ESR & CAN_ESR_REC) >> 24;
+	}
+	#endif
+	return &cal_stats[t-1];
+}
+
+/*
+ * @brief  Clears the link counters of a transport
+ * @param  Transport (CAL_USART, CAL_CAN)
+ * @retval void
+ */
+void cal_resetstats(uint8_t t) {
+	calstats_t zero = {0};
+	if (t == 0 || t > CAL_TRANSPORTS) return;
+	cal_stats[t-1] = zero;
+}
+
 /*
- * @brief  Send byte through selected communication mode
- * @param  Byte to be sent
+ * @brief  Send byte through the given transport, keeping no state: exported to
+ *         applications (see services.h)
+ * @param  Transport (CAL_USART, CAL_CAN), byte to be sent
  * @retval 0 if successful, -1 if not successful
  */
-int32_t cal_sendbyte(uint8_t b) {
+int32_t cal_txbyte(uint8_t t, uint8_t b) {
 
 	#ifdef USART
+	if (t == CAL_USART) {
+
+		/* Let a block being sent by DMA finish first. */
+		if (DMA1_Channel4->CCR & DMA_CCR4_EN) cal_waitblock(t);
 
 		USART_SendData(USART1, (uint16_t)b);
 		while (USART_GetFlagStatus(USART1, USART_FLAG_TXE) == RESET) {
 		}
 		return 0;
+	}
+	#endif
 
-	#elif defined CAN
+	#ifdef CAN
+	if (t == CAL_CAN) {
 
 		/* Refer to CANinit() for CAN configuration details. */
 
 		uint8_t mailbox;	//mailbox that will transmit the message
 		//uint32_t tries = 0, maxTries = 99;
 
-		/* Visual signal if any error has occurred. */
-		if (CAN_GetReceiveErrorCounter(CAN1) != 0)
-				GPIOA->BSRR |= GPIO_BSRR_BR0 | GPIO_BSRR_BR1 | GPIO_BSRR_BR2 | GPIO_BSRR_BR3;
-
 		/* Set up the packet info. */
 		CanTxMsg msg;
 		msg.DLC = 1;		//frame length
@@ -66,15 +179,11 @@ int32_t cal_sendbyte(uint8_t b) {
 		while (mailbox==CAN_TxStatus_NoMailBox && tries<maxTries);
 		*/
 
-		/* Visual signal if any error has occurred. */
-		if (CAN_GetReceiveErrorCounter(CAN1) != 0)
-				GPIOA->BSRR |= GPIO_BSRR_BR0 | GPIO_BSRR_BR1 | GPIO_BSRR_BR2 | GPIO_BSRR_BR3;
-
 		/* Hard Fault if no mailbox is found empty. */
 		if (mailbox==CAN_TxStatus_NoMailBox) HardFault_Handler();
 
 		return 0;
-
+	}
 	#endif
 
 	return -1;
@@ -82,65 +191,59 @@ int32_t cal_sendbyte(uint8_t b) {
 
 
 /*
- * @brief  Receive byte through selected communication mode.
- * @param  Pointer to received byte container
- * @retval 0 if successful, -1 if not successful/timeout expired
+ * @brief  Fetch a byte from the given transport if one is waiting, never blocks,
+ *         keeping no state: exported to applications (see services.h)
+ * @param  Transport (CAL_USART, CAL_CAN), pointer to received byte container
+ * @retval 0 if a byte was fetched, -1 if nothing was pending
  */
-int32_t cal_receivebyte(uint8_t *c, uint32_t timeout) {
+int32_t cal_rxbyte(uint8_t t, uint8_t *c) {
 
 	#ifdef USART
+	if (t == CAL_USART) {
+		if (USART_GetFlagStatus(USART1, USART_FLAG_RXNE) == RESET) return -1;
+		*c = USART1->DR;
+		return 0;
+	}
+	#endif
 
-		while (timeout-- > 0)	{
-			if ( USART_GetFlagStatus(USART1, USART_FLAG_RXNE) != RESET)	{
-				*c = USART1->DR;
-				return 0;
-			}
-		}
-		return -1;
-
-
-	#elif defined CAN
-
+	#ifdef CAN
+	if (t == CAL_CAN) {
 
 		/* Refer to CANinit() for CAN configuration details. */
 
 		CanRxMsg msg0;
 
-		/* Visual signal if any error has occurred. */
-		if (CAN_GetReceiveErrorCounter(CAN1) != 0)
-			GPIOA->BSRR |= GPIO_BSRR_BR0 | GPIO_BSRR_BR1 | GPIO_BSRR_BR2 | GPIO_BSRR_BR3;
-
-		/* Fetch status of receive FIFOs. */
-		//s0 = CAN1->RF0R;
-		//s1 = CAN1->RF1R;
-
-		/* Block until a message has arrived. */
-		while (!CAN_MessagePending(CAN1, CAN_FIFO0));
+		if (!CAN_MessagePending(CAN1, CAN_FIFO0)) return -1;
 
 		/* Receive the message from FIFO0.
 		 * FIFO0 is the only FIFO that will get incoming messages
 		 * as a pass-all filter is assigned to FIFO0 (CANinit())*/
 		CAN_Receive(CAN1, CAN_FIFO0, &msg0);
 
-		/* Visual signal if any error has occurred. */
-		if (CAN_GetReceiveErrorCounter(CAN1) != 0)
-				GPIOA->BSRR |= GPIO_BSRR_BR0 | GPIO_BSRR_BR1 | GPIO_BSRR_BR2 | GPIO_BSRR_BR3;
-
-		/* Receive the message from FIFO1. */
-		//CAN_Receive(CAN1, CAN_FIFO1, &msg1);
-
-		//f0 = msg0.Data[0];
-		//f1 = msg1.Data[0];
-
 		/* Extract the data. */
 		*c = msg0.Data[0];
 
 		return 0;
+	}
 	#endif
 
 	return -1;
 }
 
+/*
+ * @brief  Receive byte through the given transport, blocking until timeout.
+ *         Counted in polls, not ms: exported to applications (see services.h),
+ *         whose context has no bootloader timebase. Sessions do not use it.
+ * @param  Transport, pointer to received byte container, number of polls before giving up
+ * @retval 0 if successful, -1 if not successful/timeout expired
+ */
+int32_t cal_receivebyte(uint8_t t, uint8_t *c, uint32_t timeout) {
+	while (timeout-- > 0) {
+		if (cal_rxbyte(t, c) == 0) return 0;
+	}
+	return -1;
+}
+
 
 /*
 int32_t cal_receiveword(uint32_t *c, uint32_t timeout) {
@@ -152,17 +255,17 @@ int32_t cal_receiveword(uint32_t *c, uint32_t timeout) {
 */
 
 /*
- * @brief  Receive word(32bit) through selected communication mode
- * @param  Pointer to received word container
+ * @brief  Receive word(32bit) through the given transport, MSB first
+ * @param  Transport, pointer to received word container, timeout of each byte
  * @retval 0 if successful, -1 if not successful/timeout expired
  */
-int32_t cal_receiveword(uint32_t *c, uint32_t timeout) {
+int32_t cal_receiveword(uint8_t t, uint32_t *c, uint32_t timeout) {
 	uint32_t bytes = 0;
     uint8_t a1,a2,a3,a4;
-    cal_READBYTE(a1,TIMEOUT_NACK);
-    cal_READBYTE(a2,TIMEOUT_NACK);
-    cal_READBYTE(a3,TIMEOUT_NACK);
-    cal_READBYTE(a4,TIMEOUT_NACK);
+    cal_READBYTE(t,a1,timeout);
+    cal_READBYTE(t,a2,timeout);
+    cal_READBYTE(t,a3,timeout);
+    cal_READBYTE(t,a4,timeout);
     bytes |= a1<<24;
     bytes |= a2<<16;
     bytes |= a3<<8;
@@ -172,32 +275,98 @@ int32_t cal_receiveword(uint32_t *c, uint32_t timeout) {
 }
 
 /*
- * @brief  Send word through selected communication mode
- * @param  Word to be sent
+ * @brief  Send word through the given transport, MSB first as cal_receiveword()
+ * @param  Transport, word to be sent
  * @retval 0 if successful, -1 if not successful
  */
-int32_t cal_sendword(uint32_t b) {
-	uint8_t *p, i;
-	p = (uint8_t*)&b;
-	for (i=0; i<4; i++) cal_sendbyte(*(p+i));
+int32_t cal_sendword(uint8_t t, uint32_t b) {
+	int8_t i;
+	for (i=24; i>=0; i-=8) {
+		if (cal_sendbyte(t, (b >> i) & 0xFF) == -1) return -1;
+	}
 	return 0;
 }
 
 /**
   * @brief  Send a string string through selected communication mode
+  * @param  t: The transport to send through
   * @param  s: The string to be sent
   * @retval 0 if successful
   * 	   -1 if unsuccessful
   */
-int32_t cal_sendstring(uint8_t *s)	{
+int32_t cal_sendstring(uint8_t t, uint8_t *s)	{
 	while (*s != '\0')  {
-		if(cal_sendbyte(*s)==-1) return -1;
+		if(cal_sendbyte(t, *s)==-1) return -1;
 		s++;
 	}
 	return 0;
 }
 
 
+/*
+ * @brief  Send a block through the given transport, counting it, see cal_txblock()
+ * @param  Transport, block, number of bytes
+ * @retval 0 if successful, -1 if not successful
+ */
+int32_t cal_sendblock(uint8_t t, uint8_t *data, uint32_t n) {
+	if (t == 0 || t > CAL_TRANSPORTS || cal_txblock(t, data, n) == -1) return -1;
+	cal_stats[t-1].txbytes += n;
+	cal_stats[t-1].txframes += n;
+	#ifdef CAN
+	if (t == CAL_CAN) cal_canerrors();
+	#endif
+	return 0;
+}
+
+/*
+ * @brief  Send a block through the given transport. On USART the block is sent by
+ *         DMA1 channel 4 and the function returns at once, so that the caller
+ *         can prepare the next block meanwhile; the block must not be touched
+ *         until cal_waitblock(). Other transports send it byte by byte.
+ *         Keeps no state: exported to applications (see services.h).
+ * @param  Transport, block, number of bytes
+ * @retval 0 if successful, -1 if not successful
+ */
+int32_t cal_txblock(uint8_t t, uint8_t *data, uint32_t n) {
+
+	#ifdef USART
+	if (t == CAL_USART) {
+		cal_waitblock(t);
+		RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+		DMA1_Channel4->CCR = 0;
+		DMA1->IFCR = DMA_IFCR_CGIF4;
+		DMA1_Channel4->CPAR = (uint32_t)&USART1->DR;
+		DMA1_Channel4->CMAR = (uint32_t)data;
+		DMA1_Channel4->CNDTR = n;
+		USART1->CR3 |= USART_CR3_DMAT;
+		DMA1_Channel4->CCR = DMA_CCR4_MINC | DMA_CCR4_DIR | DMA_CCR4_EN;
+		return 0;
+	}
+	#endif
+
+	while (n-- > 0) {
+		if (cal_txbyte(t, *data++) == -1) return -1;
+	}
+	return 0;
+}
+
+/*
+ * @brief  Wait until the block passed to cal_sendblock() has been handed to the transport
+ * @param  Transport
+ * @retval void
+ */
+void cal_waitblock(uint8_t t) {
+
+	#ifdef USART
+	if (t == CAL_USART && (DMA1_Channel4->CCR & DMA_CCR4_EN)) {
+		while (!(DMA1->ISR & DMA_ISR_TCIF4));
+		DMA1_Channel4->CCR = 0;
+		DMA1->IFCR = DMA_IFCR_CGIF4;
+		USART1->CR3 &= ~USART_CR3_DMAT;
+	}
+	#endif
+}
+
 /*
  * @brief  Initialize communication layer for the desired mode
  * @param  void
@@ -206,13 +375,47 @@ int32_t cal_sendstring(uint8_t *s)	{
 int32_t cal_init(void) {
 
 	GPIOinit();
+	#ifdef CAN
+	cal_canready = (cal_transportinit() == 0);
+	#else
+	cal_transportinit();
+	#endif
+	return 0;
+}
+
+/*
+ * @brief  Initialize the transports only, their own pins read-modify-written and
+ *         nothing else: applications call it through the service table
+ * @param  void
+ * @retval 0 if successful, -1 if bxCAN did not come up (no transceiver or no
+ *         bus): the CAN transport is not usable then
+ */
+int32_t cal_transportinit(void) {
+	int32_t result = 0;
 
 	#ifdef USART
 	USARTinit();
-	#elif defined CAN
-	CANinit();
 	#endif
+	#ifdef CAN
+	result = CANinit();
+	#endif
+
+	return result;
+}
 
+/*
+ * @brief  Whether cal_init() brought a transport up
+ * @param  Transport (CAL_USART, CAL_CAN)
+ * @retval 1 if usable
+ * 		   0 if not built in or not up
+ */
+int32_t cal_available(uint8_t t) {
+	#ifdef USART
+	if (t == CAL_USART) return 1;
+	#endif
+	#ifdef CAN
+	if (t == CAL_CAN) return cal_canready;
+	#endif
 	return 0;
 }
 
@@ -227,13 +430,15 @@ void USARTinit(void) {
 		  /*Baud Rate at 115200. */
 		  uint32_t BRR=0x00000271;
 
-		  /*USART1 on APB2 bus clock enable. */
-		  RCC->APB2ENR |= RCC_APB2ENR_USART1EN;
+		  /*USART1, GPIOA and AFIO on APB2 bus clock enable. */
+		  RCC->APB2ENR |= RCC_APB2ENR_USART1EN | RCC_APB2ENR_IOPAEN | RCC_APB2ENR_AFIOEN;
 
-		  /*Configure GPIOA output and input mode for UART. */
+		  /*Configure GPIOA output and input mode for UART, only PA9 and PA10:
+		   *the other pins may belong to the application the agent is linked in. */
 		  /*USART1 TX as alternate function push-pull: bits 4-7 to 1011=B. */
 		  /*USART1 RX as input floating: bits 8-11 to 0100=4. */
-		  GPIOA->CRH = 0x444444B4;
+		  GPIOA->CRH &= 0xFFFFF00F;
+		  GPIOA->CRH |= 0x000004B0;
 
 		  /*Ensure no remap, keep PA9,PA10. */
 		  AFIO->MAPR &= ~AFIO_MAPR_USART1_REMAP;
@@ -263,9 +468,9 @@ void USARTinit(void) {
 /*
  * @brief  Initializes CAN peripheral
  * @param  void
- * @retval void
+ * @retval 0 if successful, -1 if bxCAN did not enter or leave initialization mode
  */
-void CANinit() {
+int32_t CANinit(void) {
 
 	//uint32_t stdmsgid = 0;
 
@@ -293,7 +498,7 @@ void CANinit() {
 	CAN1->MCR |= CAN_MCR_INRQ;
 
 	/* Wait until init mode entered. */
-	while (((CAN1->MSR & CAN_MSR_INAK) != CAN_MSR_INAK));
+	if (cal_caninak(CAN_MSR_INAK) == -1) return -1;
 
 	/* CAN module still working during debug. */
 	//CAN1->MCR &= ~0x00010000;
@@ -357,14 +562,31 @@ void CANinit() {
 	/*Enter CAN normal mode. */
 	CAN1->MCR &= ~CAN_MCR_INRQ;
 
-	/* Wait until normal mode entered. */
-	while (((CAN1->MSR & CAN_MSR_INAK) == CAN_MSR_INAK));
+	/* Wait until normal mode entered: never, with no transceiver or no bus. */
+	if (cal_caninak(0) == -1) return -1;
 
 	/* Exit sleep mode (need discovered while debugging). */
 	CAN1->MCR &= ~CAN_MCR_SLEEP;
 
 	/* Wait transmit mailbox empty. */
 	//while ((CAN->TSR & CAN_TSR_TME0) == 0);
+	return 0;
+}
+
+/*
+ * @brief  Waits for bxCAN to acknowledge entering or leaving initialization mode,
+ *         at most CAN_INAKTIMEOUT ms, or CAN_INAKSPINS polls where the millisecond
+ *         timebase is not running (service table)
+ * @param  CAN_MSR_INAK to wait for initialization mode, 0 for normal mode
+ * @retval 0 if successful, -1 on timeout
+ */
+int32_t cal_caninak(uint32_t inak) {
+	uint32_t start = hil_millis(), spins = 0;
+
+	while ((CAN1->MSR & CAN_MSR_INAK) != inak) {
+		if (hil_millis() - start >= CAN_INAKTIMEOUT || ++spins >= CAN_INAKSPINS) return -1;
+	}
+	return 0;
 }
 
 
@@ -392,8 +614,106 @@ void GPIOinit(void) {
 	  GPIOA->BSRR |= GPIO_BSRR_BR0 | GPIO_BSRR_BR1 | GPIO_BSRR_BS2 | GPIO_BSRR_BS3;
 }
 
-void cal_baudrate(void) {
-	return;
+/*
+ * @brief  Enable the receive interrupt of the given transport, so that its bytes
+ *         are fetched as they arrive even while another transport is busy
+ * @param  Transport (CAL_USART, CAL_CAN)
+ * @retval void
+ */
+void cal_enableinterrupt(uint8_t t) {
+	#ifdef USART
+	if (t == CAL_USART) {
+		USART1->CR1 |= USART_CR1_RXNEIE;
+		NVIC_EnableIRQ(USART1_IRQn);
+	}
+	#endif
+	#ifdef CAN
+	if (t == CAL_CAN) {
+		CAN1->IER |= CAN_IER_FMPIE0;
+		NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+	}
+	#endif
+}
+
+/*
+ * @brief  Disable the receive interrupt of the given transport
+ * @param  Transport (CAL_USART, CAL_CAN)
+ * @retval void
+ */
+void cal_disableinterrupt(uint8_t t) {
+	#ifdef USART
+	if (t == CAL_USART) {
+		NVIC_DisableIRQ(USART1_IRQn);
+		USART1->CR1 &= ~USART_CR1_RXNEIE;
+	}
+	#endif
+	#ifdef CAN
+	if (t == CAL_CAN) {
+		NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+		CAN1->IER &= ~CAN_IER_FMPIE0;
+	}
+	#endif
+}
+
+/*
+ * @brief  Changes the baud rate of a transport, USART_BAUD and CAN_BAUD otherwise
+ * @param  Transport, baud rate (bit rate on CAN)
+ * @retval 0 if successful, -1 if not successful
+ *
+ * On CAN only the prescaler changes, the bit timing staying 3 + CAN_TS1 + CAN_TS2 quanta.
+ */
+int32_t cal_baudrate(uint8_t t, uint32_t baud) {
+	RCC_ClocksTypeDef clocks;
+	uint32_t prescaler;
+
+	if (baud == 0) return -1;
+	RCC_GetClocksFreq(&clocks);
+
+	#ifdef USART
+	if (t == CAL_USART) {
+		USART1->CR1 &= ~USART_CR1_UE;
+		USART1->BRR = clocks.PCLK2_Frequency / baud;
+		USART1->CR1 |= USART_CR1_UE;
+		return 0;
+	}
+	#endif
+
+	#ifdef CAN
+	if (t == CAL_CAN) {
+		prescaler = clocks.PCLK1_Frequency / (baud * (3 + CAN_TS1 + CAN_TS2));
+		if (prescaler == 0 || prescaler > CAN_BTR_BRP + 1) return -1;
+
+		/* Bit timing only changes in initialization mode. */
+		CAN1->MCR |= CAN_MCR_INRQ;
+		if (cal_caninak(CAN_MSR_INAK) == -1) return -1;
+		CAN1->BTR = (CAN1->BTR & ~CAN_BTR_BRP) | (prescaler - 1);
+		CAN1->MCR &= ~CAN_MCR_INRQ;
+		return cal_caninak(0);
+	}
+	#endif
+
+	return -1;
+}
+
+/*
+ * @brief  Current baud rate of a transport
+ * @param  Transport
+ * @retval baud rate (bit rate on CAN), 0 if the transport is not built in
+ */
+uint32_t cal_getbaudrate(uint8_t t) {
+	RCC_ClocksTypeDef clocks;
+
+	RCC_GetClocksFreq(&clocks);
+
+	#ifdef USART
+	if (t == CAL_USART) return clocks.PCLK2_Frequency / USART1->BRR;
+	#endif
+
+	#ifdef CAN
+	if (t == CAL_CAN) return clocks.PCLK1_Frequency / (((CAN1->BTR & CAN_BTR_BRP) + 1) * (3 + CAN_TS1 + CAN_TS2));
+	#endif
+
+	return 0;
 }
 
 /**************************** Politecnico di Milano ************END OF FILE****/
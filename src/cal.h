@@ -10,18 +10,34 @@
 
 #include "includes.h"
 #include "hil.h"
+#include "log.h"
+
+#ifndef CAL_H
+#define CAL_H
 
 /* Communication peripheral selection --------------------------------------- */
-/* Uncomment the intended device -------------------------------------------- */
+/* Both devices are served at the same time, comment one out to leave it out */
 #define USART 1
-//#define CAN 2
+#define CAN 2
+
+/* Transport identifiers, a session is bound to one of them. */
+#define CAL_USART		(1)
+#define CAL_CAN			(2)
+#define CAL_TRANSPORTS	(2)
+
+#ifdef USART
+#define CAL_DEFAULT		CAL_USART
+#elif defined CAN
+#define CAL_DEFAULT		CAL_CAN
+#endif
 
 /* Global variables --------------------------------------------------- */
 //uint8_t comm_peripheral;
 
 #ifdef USART
 #include "stm32f10x_usart.h"
-#elif defined CAN
+#endif
+#ifdef CAN
 #include "stm32f10x_can.h"
 #endif
 
@@ -35,58 +51,103 @@
 #define CAN_TS2			(0x2)
 #define CAN_BRP			(0x3)
 #define CAN_SJW			(0x1)
-#define TIMEOUT_NACK 	(0xFFFFFF)
-#define TIMEOUT_INIT 	(0xFFFFFFFF)
 #define MSGID			(0x00);
+#define CAN_INAKTIMEOUT	(10)		/* ms for bxCAN to enter or leave initialization mode */
+#define CAN_INAKSPINS	(100000)	/* same bound where the millisecond timebase is not running */
+
+/* Link counters of a transport, see cal_getstats(). Frames are CAN messages on
+ * CAN and characters on USART. */
+typedef struct {
+	uint32_t txbytes;
+	uint32_t rxbytes;
+	uint32_t txframes;
+	uint32_t rxframes;
+	uint32_t checksums;			/* commands NACKed for a bad checksum or complement */
+	uint32_t timeouts;			/* commands NACKed and sessions dropped on a timeout */
+	uint32_t overruns;			/* USART: bytes received with ORE set */
+	uint32_t framing;			/* USART: bytes received with FE set */
+	uint32_t noise;				/* USART: bytes received with NE set */
+	uint32_t busoff;			/* CAN: bus-off entries */
+	uint32_t lost;				/* CAN: FIFO 0 overruns, a message lost each */
+	uint32_t tec;				/* CAN: transmit error counter, as last read */
+	uint32_t rec;				/* CAN: receive error counter, as last read */
+} calstats_t;
 
 
 /* Exported functions ------------------------------------------------------- */
 int32_t cal_init(void);
-void cal_baudrate(void); //Don't need any parameters, default value is 115200
-int32_t cal_sendbyte(uint8_t b);    //want to return value to say whether sending succeed or not, within sendbyte, there is a mechanism that will do checksum
-int32_t cal_receivebyte(uint8_t *c, uint32_t timeout);  // if it receives sth,return exact byte, otherwise return -1;remember to cast from 1 byte to 4 bytes
-int32_t cal_receiveword(uint32_t *c, uint32_t timeout);
-int32_t cal_sendword(uint32_t b);
-int32_t cal_sendstring(uint8_t *s);
+int32_t cal_transportinit(void);
+int32_t cal_available(uint8_t t);
+void cal_enableinterrupt(uint8_t t);
+void cal_disableinterrupt(uint8_t t);
+int32_t cal_baudrate(uint8_t t, uint32_t baud);
+uint32_t cal_getbaudrate(uint8_t t);
+int32_t cal_sendbyte(uint8_t t, uint8_t b);    //want to return value to say whether sending succeed or not, within sendbyte, there is a mechanism that will do checksum
+int32_t cal_pollbyte(uint8_t t, uint8_t *c);   //non-blocking, 0 if a byte was waiting, -1 otherwise
+int32_t cal_receivebyte(uint8_t t, uint8_t *c, uint32_t timeout);  // if it receives sth,return exact byte, otherwise return -1;remember to cast from 1 byte to 4 bytes
+int32_t cal_receiveword(uint8_t t, uint32_t *c, uint32_t timeout);
+int32_t cal_sendword(uint8_t t, uint32_t b);
+int32_t cal_sendstring(uint8_t t, uint8_t *s);
+int32_t cal_sendblock(uint8_t t, uint8_t *data, uint32_t n);
+void cal_waitblock(uint8_t t);
+calstats_t *cal_getstats(uint8_t t);
+void cal_resetstats(uint8_t t);
+
+/* Stateless transport routines, exported to applications (see services.h). */
+int32_t cal_txbyte(uint8_t t, uint8_t b);
+int32_t cal_rxbyte(uint8_t t, uint8_t *c);
+int32_t cal_txblock(uint8_t t, uint8_t *data, uint32_t n);
 
 /* Private function prototypes --------------------------------------------- */
 void GPIOinit(void);
 void USARTinit(void);
-void CANinit(void);
+int32_t CANinit(void);
+int32_t cal_caninak(uint32_t inak);
+void cal_canerrors(void);
 
 /* Useful macros ----------------------------------------------------------- */
-#define cal_READBYTE(x, timeout)\
-  if(cal_receivebyte((uint8_t *)&x, timeout) == -1 )\
+/* The transport t comes first, as in the functions they wrap. */
+#define cal_READBYTE(t, x, timeout)\
+  if(cal_receivebyte(t, (uint8_t *)&x, timeout) == -1 )\
     return -1
 
-#define cal_READWORD(x, timeout)\
-  if(cal_receiveword((uint32_t *)&x, timeout) == -1 )\
+#define cal_READWORD(t, x, timeout)\
+  if(cal_receiveword(t, (uint32_t *)&x, timeout) == -1 )\
     return -1
 
-#define cal_SENDBYTE(x)\
-  if(cal_sendbyte(x)==-1)\
+#define cal_SENDBYTE(t, x)\
+  if(cal_sendbyte(t, x)==-1)\
 	return -1
 
-#define cal_SENDNACK()\
-  cal_sendbyte(STM32_COMM_NACK);\
+#define cal_SENDWORD(t, x)\
+  if(cal_sendword(t, x)==-1)\
+	return -1
+
+#define cal_SENDBLOCK(t, x, n)\
+  if(cal_sendblock(t, x, n)==-1)\
+	return -1
+
+#define cal_SENDNACK(t)\
+  cal_sendbyte(t, STM32_COMM_NACK);\
     return -1
 
-#define cal_SENDACK()\
-  if(cal_sendbyte(STM32_COMM_ACK)==-1)\
+#define cal_SENDACK(t)\
+  if(cal_sendbyte(t, STM32_COMM_ACK)==-1)\
     return -1
 
 /* LOG macros ------------------------------------------------------------------ */
 
 /* Swap desired commented define statement in order to enable-disable logging info. */
-/* Trick is to replace the sending of a string with empty code at compile time. */
-#define cal_SENDLOG(x)
+/* Log records go to the RAM log (see log.h), never to the protocol's transport;
+ * the trick to compile them out is to replace them with empty code. */
+#define cal_SENDLOG(x)	log_text(x)
 /*
-#define cal_SENDLOG(x)\
-  if(cal_sendstring((uint8_t*)x))\
-  	return -1
+#define cal_SENDLOG(x)
 */
 
 
 
 
+#endif /* CAL_H */
+
 /**************************** Politecnico di Milano ************END OF FILE****/
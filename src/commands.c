@@ -15,126 +15,521 @@
   * @{
   */
 
+/* Private macro ------------------------------------------------------------ */
+/* Abort the command being served: rearm the parser for a new command code
+ * first, so that nothing the host sends after the NACK is lost, then NACK. */
+#define command_ABORT(s)\
+  command_done(s);\
+  cal_SENDNACK((s)->transport)
+
+/* Global variables --------------------------------------------------------- */
+/* One session per transport, indexed by transport identifier - 1. */
+session_t command_sessions[CAL_TRANSPORTS];
+
+/* Session currently allowed to modify the FLASH, 0 if none. */
+session_t *command_flashowner;
+
+/* Static buffer pool, in the .bufpool section at the start of the RAM (see the
+ * linker script). Bytes are received straight into these buffers: two per
+ * session, swapped when a block is handed to the program job, and the page
+ * being assembled by the flash owner before it is written as a whole. */
+uint32_t command_stagingpage[FLASHPAGESIZE/4] COMMAND_BUFPOOL;
+uint8_t command_bufferpool[2*CAL_TRANSPORTS][SESSION_BUFSIZE] COMMAND_BUFPOOL __attribute__ ((aligned (4)));
+
+/* Operations of a batch command, received whole before being run. */
+uint8_t command_batchbuffer[COMMAND_BATCHSIZE] COMMAND_BUFPOOL __attribute__ ((aligned (4)));
+
+/* Program job of the flash owner. */
+flashjob_t command_job;
+
+/* Batch being run, by the flash owner only. */
+batchrun_t command_batchrun;
+
+/* Dump and link self-test of each session, indexed by transport identifier - 1. */
+dumprun_t command_dumpruns[CAL_TRANSPORTS];
+benchrun_t command_benchruns[CAL_TRANSPORTS];
+
+/* Session timeouts, set by the host with the timeouts command. */
+timeouts_t command_timeout = {COMMAND_INTERBYTE, COMMAND_PHASETIMEOUT, COMMAND_SESSIONTIMEOUT};
+
+/* Page held by command_stagingpage for write-combining, COMMAND_NOPAGE if none. */
+uint32_t command_stagedpage = COMMAND_NOPAGE;
+
+/* Handlers of the command codes accepted after the init byte. */
+const command_t command_table[] = {
+	{STM32_CMD_GET_COMMAND,					command_get_command},
+	{STM32_CMD_GETVERSION_READPROTECTION,	command_get_version},
+	{STM32_CMD_GET_ID,						command_get_id},
+	{STM32_CMD_READ_MEMORY,					command_read_memory},
+	{STM32_CMD_WRITE_MEMORY,				command_write_memory},
+#ifndef CBBL_AGENT
+	{STM32_CMD_GO,							command_go},
+#endif
+	{STM32_CMD_ERASE,						command_erase},
+	{STM32_CMD_EXTENDED_ERASE,				command_extended_erase},
+#ifndef CBBL_AGENT
+	{STM32_CMD_WRITE_PROTECT,				command_write_protect},
+	{STM32_CMD_WRITE_UNPROTECT,				command_write_unprotect},
+	{STM32_CMD_READOUT_PROTECT,				command_readout_protect},
+	{STM32_CMD_READOUT_UNPROTECT,			command_readout_unprotect},
+#endif
+	{CBBL_CMD_WRITE_CHANGED,				command_write_changed},
+	{CBBL_CMD_PAGE_HASHES,					command_page_hashes},
+	{CBBL_CMD_VERIFY_CRC,					command_verify_crc},
+	{CBBL_CMD_BATCH,						command_batch},
+	{CBBL_CMD_FILL,							command_fill},
+	{CBBL_CMD_DUMP,							command_dump},
+	{CBBL_CMD_JOURNAL,						command_journal},
+	{CBBL_CMD_SLOT,							command_slot},
+	{CBBL_CMD_MANIFEST,						command_manifest},
+	{CBBL_CMD_TIMEOUTS,						command_timeouts},
+	{CBBL_CMD_STATS,						command_stats},
+#ifdef CBBL_PROFILE
+	{CBBL_CMD_PROFILE,						command_profile},
+#endif
+	{CBBL_CMD_LOG,							command_log},
+	{CBBL_CMD_BENCH,						command_bench},
+};
+#define COMMAND_TABLE_SIZE (sizeof(command_table)/sizeof(command_table[0]))
+
+/* Command codes returned by the get command, extended erase excluded as
+ * Erase and Extended Erase are mutually exclusive. */
+const uint8_t command_advertised[] = {
+	STM32_CMD_GET_COMMAND,
+	STM32_CMD_GETVERSION_READPROTECTION,
+	STM32_CMD_GET_ID,
+	STM32_CMD_READ_MEMORY,
+#ifndef CBBL_AGENT
+	STM32_CMD_GO,
+#endif
+	STM32_CMD_WRITE_MEMORY,
+	STM32_CMD_ERASE,
+#ifndef CBBL_AGENT
+	STM32_CMD_WRITE_PROTECT,
+	STM32_CMD_WRITE_UNPROTECT,
+	STM32_CMD_READOUT_PROTECT,
+	STM32_CMD_READOUT_UNPROTECT,
+#endif
+	CBBL_CMD_WRITE_CHANGED,
+	CBBL_CMD_PAGE_HASHES,
+	CBBL_CMD_VERIFY_CRC,
+	CBBL_CMD_BATCH,
+	CBBL_CMD_FILL,
+	CBBL_CMD_DUMP,
+	CBBL_CMD_JOURNAL,
+	CBBL_CMD_SLOT,
+	CBBL_CMD_MANIFEST,
+	CBBL_CMD_TIMEOUTS,
+	CBBL_CMD_STATS,
+#ifdef CBBL_PROFILE
+	CBBL_CMD_PROFILE,
+#endif
+	CBBL_CMD_LOG,
+	CBBL_CMD_BENCH,
+};
+
 /*
- * @brief  Receives the command code from the host side and accordingly runs the command
- * @param  void
- * @retval 0: successful
- * 		  -1: command code not found or timeout expired or incorrect command code complement
- */
-int32_t receivecommand(void) {
-	uint8_t p;
-	uint8_t q; //q must equal !p
-	cal_READBYTE(p, TIMEOUT_NACK);
-	switch(p) {
-		case STM32_CMD_GET_COMMAND :
-			cal_SENDLOG("-> first byte: get command \r\n");
-			cal_READBYTE(q, TIMEOUT_NACK);
-			uint8_t t = (~(uint8_t)(STM32_CMD_GET_COMMAND));
-			if (q==t) {
-				return command_get_command();
-			}
-			else cal_SENDNACK();
-		case STM32_CMD_ERASE :
-			cal_READBYTE(q, TIMEOUT_NACK);
-			if (q== (uint8_t)~STM32_CMD_ERASE) {
-				return command_erase();
-			}
-			else cal_SENDNACK();
-		case STM32_CMD_GET_ID :
-			cal_READBYTE(q, TIMEOUT_NACK);
-			if (q== (uint8_t)~STM32_CMD_GET_ID) {
-				return command_get_id();
-			}
-			else cal_SENDNACK();
-		case STM32_CMD_WRITE_MEMORY :
-			cal_READBYTE(q, TIMEOUT_NACK);
-			if (q== (uint8_t)~STM32_CMD_WRITE_MEMORY) {
-				return command_write_memory();
-			}
-			else cal_SENDNACK();
-		case STM32_CMD_WRITE_UNPROTECT :
-			cal_READBYTE(q, TIMEOUT_NACK);
-			if (q== (uint8_t)~STM32_CMD_WRITE_UNPROTECT) {
-				return command_write_unprotect();
-			}
-			else cal_SENDNACK();
-		case STM32_CMD_READ_MEMORY :
-			cal_READBYTE(q, TIMEOUT_NACK);
-			if (q== (uint8_t)~STM32_CMD_READ_MEMORY) {
-				return command_read_memory();
-			}
-			else cal_SENDNACK();
-		case STM32_CMD_GETVERSION_READPROTECTION :
-			cal_READBYTE(q, TIMEOUT_NACK);
-			if (q== (uint8_t)~STM32_CMD_GETVERSION_READPROTECTION) {
-				return command_get_version();
-			}
-			else cal_SENDNACK();
-		case STM32_CMD_GO :
-			cal_READBYTE(q, TIMEOUT_NACK);
-			if (q== (uint8_t)~STM32_CMD_GO) {
-				return command_go();
-			}
-			else cal_SENDNACK();
-		case STM32_CMD_EXTENDED_ERASE :
-			cal_READBYTE(q, TIMEOUT_NACK);
-			if (q== (uint8_t)~STM32_CMD_EXTENDED_ERASE) {
-				return command_extended_erase();
-			}
-			else cal_SENDNACK();
-		case STM32_CMD_WRITE_PROTECT :
-			cal_READBYTE(q, TIMEOUT_NACK);
-			if (q== (uint8_t)~STM32_CMD_WRITE_PROTECT) {
-				return command_write_protect();
-			}
-			else cal_SENDNACK();
-		case STM32_CMD_READOUT_PROTECT :
-			cal_READBYTE(q, TIMEOUT_NACK);
-			if (q == (uint8_t)~STM32_CMD_READOUT_PROTECT) {
-				return command_readout_protect();
-			}
-			else cal_SENDNACK();
-		case STM32_CMD_READOUT_UNPROTECT :
-			cal_READBYTE(q, TIMEOUT_NACK);
-			if (q == (uint8_t)~STM32_CMD_READOUT_UNPROTECT) {
-				return command_readout_unprotect();
-			}
-			else cal_SENDNACK();
+ * @brief  Binds a session to a transport and resets its parser to wait for the init byte
+ * @param  session, transport (CAL_USART, CAL_CAN)
+ * @retval void
+ */
+void command_sessioninit(session_t *s, uint8_t transport) {
+	s->transport = transport;
+	s->buffer = command_bufferpool[2*(transport-1)];
+	s->spare = command_bufferpool[2*(transport-1)+1];
+	s->handler = 0;
+	s->phase = 0;
+	s->count = 0;
+	s->expected = 0;
+	s->received = 0;
+	s->last = hil_millis();
+	s->started = s->last;
+	s->state = SESSION_STATE_INIT;
+}
+
+/*
+ * @brief  Pushes one received byte into the session's parser
+ * @param  session, received byte
+ * @retval void
+ *
+ * Only moves the parser state, never talks to the host nor touches the flash,
+ * so it may be called from the transport's receive ISR. Whatever the byte
+ * completes (init, command code, handler phase) is run by command_process().
+ */
+void command_feedbyte(session_t *s, uint8_t b) {
+	uint32_t i;
+
+	s->received = 1;
+	switch (s->state) {
+		case SESSION_STATE_OPCODE :
+			/* A host retrying the init sequence gets acked again. */
+			if (b != STM32_CMD_INIT) {
+				s->opcode = b;
+				s->state = SESSION_STATE_COMPLEMENT;
+				break;
+			}
+			/* no break */
+		case SESSION_STATE_INIT :
+			if (b == STM32_CMD_INIT) {
+				s->handler = command_init;
+				s->phase = 0;
+				s->state = SESSION_STATE_EXECUTE;
+			}
+			break;
+		case SESSION_STATE_COMPLEMENT :
+			s->handler = command_nack;
+			if (b == (uint8_t)~s->opcode) {
+				for (i = 0; i < COMMAND_TABLE_SIZE; i++) {
+					if (command_table[i].opcode == s->opcode) s->handler = command_table[i].handler;
+				}
+			}
+			s->phase = 0;
+			s->state = SESSION_STATE_EXECUTE;
+			break;
+		case SESSION_STATE_COLLECT :
+			/* Checksum folded in a word at a time, the buffer being word-aligned. */
+			if (s->count == 0) PROFILE_MARK(s->since);
+			s->buffer[s->count++] = b;
+			if ((s->count & 0x3) == 0) s->xor32 ^= *(uint32_t*)(s->buffer + s->count - 4);
+			if (s->count == s->expected) {
+				PROFILE_SINCE(PROFILE_RECEIVE, s->since);
+				PROFILE_MARK(s->since);
+				for (i = s->count & ~0x3; i < s->count; i++) s->xor32 ^= s->buffer[i];
+				s->xor32 ^= s->xor32 >> 16;
+				s->checksum = (uint8_t)(s->xor32 ^ (s->xor32 >> 8));
+				PROFILE_SINCE(PROFILE_CHECKSUM, s->since);
+				s->state = SESSION_STATE_EXECUTE;
+			}
+			break;
+		default :
+			/* Host did not wait for the reply of the previous phase, drop. */
+			break;
+	}
+}
+
+/*
+ * @brief  Runs the pending handler step of the session and keeps track of timeouts
+ * @param  session
+ * @retval 0: session alive
+ * 		  -1: the session was dropped, no command within the session timeout
+ *
+ * Also advances the program job by one word, so that programming a block overlaps
+ * with receiving the next one.
+ * A handler step returning -1 with the session still in SESSION_STATE_EXECUTE
+ * aborts the command; returning 0 in that state means "busy, call me again".
+ * A timeout in the middle of a command NACKs it and rearms the parser for a new
+ * command code, so the host and the device never disagree on the protocol position.
+ * Timeouts are in ms (see timeouts_t) and the times of the bytes are taken here,
+ * not in command_feedbyte(), so that the byte path never reads the timebase.
+ */
+int32_t command_process(session_t *s) {
+	uint32_t now = hil_millis(), collected = s->count;
+
+	/* The count is read first: a byte it includes has its flag already set. */
+	if (s->received) {
+		s->received = 0;
+		s->last = now;
+	}
+	command_runjob();
+	switch (s->state) {
+		case SESSION_STATE_EXECUTE :
+			/* Handler steps see the FLASH only once the program job is over,
+			 * and the flash owner's steps but a write memory or a batch (which
+			 * combines its own writes) with the combined page written; the
+			 * staging page is the owner's, other sessions leave it alone. */
+			if (command_job.length != 0) break;
+			if (s == command_flashowner && s->opcode != STM32_CMD_WRITE_MEMORY && s->opcode != CBBL_CMD_BATCH) command_flush();
+			PROFILE_START(PROFILE_RESPONSE);
+			if (s->handler(s) == -1 && s->state == SESSION_STATE_EXECUTE) command_done(s);
+			PROFILE_STOP(PROFILE_RESPONSE);
+			break;
+		case SESSION_STATE_OPCODE :
+			/* A host that stopped talking is gone: the FLASH is given back
+			 * and the session waits for the init byte again. */
+			if (now - s->last >= command_timeout.session && now - s->started >= command_timeout.session) {
+				cal_SENDLOG("-> session timed out \r\n");
+				cal_getstats(s->transport)->timeouts++;
+				if (command_flashowner == s) {
+					command_flush();
+					command_flashowner = 0;
+				}
+				s->state = SESSION_STATE_INIT;
+				return -1;
+			}
+			break;
+		case SESSION_STATE_COMPLEMENT :
+		case SESSION_STATE_COLLECT :
+			/* The first byte of a phase is only bound by the phase timeout. */
+			if (((s->state == SESSION_STATE_COMPLEMENT || collected > 0) && now - s->last >= command_timeout.interbyte) ||
+				(s->state == SESSION_STATE_COLLECT && now - s->started >= command_timeout.phase)) {
+				cal_SENDLOG("-> command timed out \r\n");
+				cal_getstats(s->transport)->timeouts++;
+				command_done(s);
+				cal_sendbyte(s->transport, STM32_COMM_NACK);
+			}
+			break;
 		default :
-			cal_SENDLOG("-> received command failed \r\n");
-			cal_SENDNACK();  //-1 means no command to receive or receive bytes that is not recognized
 			break;
 	}
 	return 0;
 }
 
 /*
- * @brief  Receives initialization sequence from the host
- * @param  void
- * @retval 0: successful
- * 		  -1: wrong initialization byte or timeout expired
+ * @brief  Polling driver of a session: feeds the byte waiting on its transport, if any,
+ *         then processes the session
+ * @param  session
+ * @retval as command_process()
+ */
+int32_t command_poll(session_t *s) {
+	uint8_t b;
+	if (cal_pollbyte(s->transport, &b) == 0) command_feedbyte(s, b);
+	return command_process(s);
+}
+
+/*
+ * @brief  Interrupt driver of a session: feeds every byte waiting on the transport
+ *         to the session bound to it. Called from the transport's receive ISR.
+ * @param  transport (CAL_USART, CAL_CAN)
+ * @retval void
+ */
+void command_rxisr(uint8_t transport) {
+	uint8_t b;
+	while (cal_pollbyte(transport, &b) == 0) command_feedbyte(command_getsession(transport), b);
+}
+
+/*
+ * @brief  Session bound to a transport
+ * @param  transport (CAL_USART, CAL_CAN)
+ * @retval the session
+ */
+session_t *command_getsession(uint8_t transport) {
+	return &command_sessions[transport - 1];
+}
+
+/*
+ * @brief  Flash arbitration between sessions: the first session issuing a command
+ *         that modifies the FLASH owns it until the session times out
+ *         (see command_process()) or jumps to the application.
+ *         Reads are never arbitrated. The FLASH about to change, the image
+ *         found valid at boot is forgotten (see slot_checkimage()).
+ * @param  session
+ * @retval 0: the session owns the FLASH
+ * 		  -1: another session owns it, the command is to be NACKed
+ */
+int32_t command_claimflash(session_t *s) {
+	if (command_flashowner != 0 && command_flashowner != s) return -1;
+	if (command_flashowner == 0) slot_forgetimage();
+	command_flashowner = s;
+	return 0;
+}
+
+/*
+ * @brief  Receives initialization sequence from the host and serves its commands,
+ *         on one transport or on every transport at the same time
+ * @param  transport (CAL_USART, CAL_CAN, 0 or any other value for every transport),
+ *         listen window: ms to wait for the init byte,
+ *         code of the command whose reset is resumed (see command_reset()),
+ *         COMMAND_NORESUME if none
+ * @retval -1: no init byte received within the listen window, or every session
+ * 		   timed out and the window is over, on the transports served;
+ * 		   does not return otherwise, it will jump away when the command_go is requested
  */
-int32_t command_receiveinit() {
+int32_t command_receiveinit(uint8_t transport, uint32_t window, uint32_t resume) {
+	uint8_t t, waiting, served;
+	uint32_t start = hil_millis();
+	session_t *s;
+
 	cal_SENDLOG("-> waiting for init byte \r\n");
-	uint8_t p;
-	cal_READBYTE(p, TIMEOUT_INIT);
-	if(p==STM32_CMD_INIT) {
-		GPIOA->BSRR |= GPIO_BSRR_BS0 | GPIO_BSRR_BR1 | GPIO_BSRR_BR2 | GPIO_BSRR_BR3;
-		cal_SENDACK();
-		cal_SENDLOG("-> init byte received \r\n");
-		cal_baudrate();
-		//NEED TO WRITE UNPROTECT SECTOR 1 (PAGES 0-3) AS THEY ARE AUTOMATICALLY WRITE PROTECTED
-		//START OFF WITH READ PROTECTION ACTIVE BY ERASING OPTION BYTES AS BULK
-		// Enter into infinite loop, it will jump away when the command_go is requested
-		while (1) {
-			receivecommand();
+	command_flashowner = 0;
+	if (transport > CAL_TRANSPORTS) transport = 0;
+	for (t = 1; t <= CAL_TRANSPORTS; t++) {
+		command_sessioninit(command_getsession(t), t);
+	}
+
+	/* Transports that did not come up (see cal_available()) are not served. */
+	served = 0;
+	for (t = 1; t <= CAL_TRANSPORTS; t++) {
+		if ((transport != 0 && t != transport) || !cal_available(t)) continue;
+		cal_enableinterrupt(t);
+		served++;
+	}
+
+	/* Back from a reset of ours: already connected, tell the host. */
+	if (resume != COMMAND_NORESUME && transport != 0 && transport <= CAL_TRANSPORTS) {
+		s = command_getsession(transport);
+		command_done(s);
+		cal_SENDLOG("-> session resumed \r\n");
+		cal_sendbyte(transport, CBBL_COMM_READY);
+		cal_sendbyte(transport, (uint8_t)resume);
+	}
+
+	do {
+		waiting = 0;
+		log_drain();
+		for (t = 1; t <= CAL_TRANSPORTS; t++) {
+			if ((transport != 0 && t != transport) || !cal_available(t)) continue;
+			command_process(command_getsession(t));
+			if (command_getsession(t)->state == SESSION_STATE_INIT) waiting++;
+		}
+	} while (waiting < served || hil_millis() - start < window);
+
+	for (t = 1; t <= CAL_TRANSPORTS; t++) cal_disableinterrupt(t);
+	GPIOA->BSRR |= GPIO_BSRR_BS0 | GPIO_BSRR_BS1 | GPIO_BSRR_BR2 | GPIO_BSRR_BR3;
+	cal_SENDLOG("-> receive init fail \r\n");
+	return -1;
+}
+
+/*
+ * @brief  Resets the device keeping the session: the bootloader comes back on the
+ *         same transport and baud rate, connected, and sends CBBL_COMM_READY
+ *         followed by the code of the command
+ * @param  session
+ * @retval none, the device resets
+ */
+void command_reset(session_t *s) {
+	hil_resetsession(s->transport, cal_getbaudrate(s->transport), s->opcode);
+}
+
+/*
+ * @brief  Arms the next handler phase: the parser collects n bytes and then calls
+ *         the handler again with phase incremented
+ * @param  session, number of bytes to collect (1 to SESSION_BUFSIZE)
+ * @retval void
+ *
+ * Must be called before the reply that lets the host send those bytes.
+ */
+void command_expect(session_t *s, uint32_t n) {
+	s->started = hil_millis();
+	s->expected = n;
+	s->count = 0;
+	s->xor32 = 0;
+	s->phase++;
+	s->state = SESSION_STATE_COLLECT;
+}
+
+/*
+ * @brief  Ends the command being served, the parser waits for a new command code
+ * @param  session
+ * @retval void
+ *
+ * Must be called before the last reply of the command.
+ */
+void command_done(session_t *s) {
+	s->started = hil_millis();
+	s->phase = 0;
+	s->state = SESSION_STATE_OPCODE;
+}
+
+/*
+ * @brief  Splits a long command in handler steps: the handler is called again, in
+ *         the given phase, at the next command_process() of the session, nothing
+ *         being collected in between, so that the other sessions are served
+ * @param  session, phase of the next step
+ * @retval void
+ *
+ * The host waits for the reply meanwhile; the last step calls command_done().
+ */
+void command_continue(session_t *s, uint8_t phase) {
+	s->phase = phase;
+	s->state = SESSION_STATE_EXECUTE;
+}
+
+/*
+ * @brief  Programs the next word of the program job, if any
+ * @param  void
+ * @retval void
+ */
+void command_runjob(void) {
+	if (command_job.length == 0) return;
+	PROFILE_START(PROFILE_FLASH);
+	if (FLASH_ProgramWord(command_job.addr, *(uint32_t*)command_job.data) != FLASH_COMPLETE) {
+		PROFILE_STOP(PROFILE_FLASH);
+		command_job.error = 1;
+		command_job.length = 0;
+		return;
+	}
+	PROFILE_STOP(PROFILE_FLASH);
+	command_job.addr += 4;
+	command_job.data += 4;
+	command_job.length = (command_job.length > 4) ? command_job.length - 4 : 0;
+}
+
+/*
+ * @brief  Write-combining: merges bytes into the staged page, loading it from the
+ *         FLASH first so that unaligned heads and tails keep the current contents.
+ *         Moving to another page writes the staged one.
+ * @param  address, bytes, number of bytes
+ * @retval 0 if successful
+ * 		  -1 if writing a staged page failed
+ */
+int32_t command_combine(uint32_t addr, uint8_t *data, uint32_t n) {
+	uint32_t page, i;
+
+	while (n > 0) {
+		page = addr & ~(FLASHPAGESIZE-1);
+		if (page != command_stagedpage) {
+			if (command_flush() == -1) return -1;
+			for (i = 0; i < FLASHPAGESIZE/4; i++) command_stagingpage[i] = hil_readFLASH(page + 4*i);
+			command_stagedpage = page;
 		}
+		((uint8_t*)command_stagingpage)[addr - page] = *data++;
+		addr++;
+		n--;
 	}
-	else {
-		GPIOA->BSRR |= GPIO_BSRR_BS0 | GPIO_BSRR_BS1 | GPIO_BSRR_BR2 | GPIO_BSRR_BR3;
-		cal_SENDLOG("-> receive init fail \r\n");
+	return 0;
+}
+
+/*
+ * @brief  Writes the staged page, if any, with hil_writepage(): unchanged
+ *         half-words are not programmed and the page is erased only if needed
+ * @param  void
+ * @retval 0 if successful
+ * 		  -1 if not successful, also reported to the next write
+ */
+int32_t command_flush(void) {
+	uint32_t page = command_stagedpage;
+
+	if (page == COMMAND_NOPAGE) return 0;
+	command_stagedpage = COMMAND_NOPAGE;
+	PROFILE_START(PROFILE_FLASH);
+	if (hil_writepage(page, command_stagingpage) == -1) {
+		PROFILE_STOP(PROFILE_FLASH);
+		command_job.error = 1;
 		return -1;
 	}
+	PROFILE_STOP(PROFILE_FLASH);
+	return 0;
+}
+
+/*
+ * @brief  Checks the checksum of a phase, counting the bad ones (see calstats_t)
+ * @param  session, XOR of the phase and of whatever its checksum also covers
+ * @retval 1 if the checksum is bad
+ * 		   0 if not
+ */
+int32_t command_badsum(session_t *s, uint8_t residue) {
+	if (residue == 0) return 0;
+	cal_getstats(s->transport)->checksums++;
+	return 1;
+}
+
+/*
+ * @brief  Assembles four collected bytes, MSB first, into a word
+ * @param  session, offset of the first byte in the phase
+ * @retval the word
+ */
+uint32_t command_getword(session_t *s, uint32_t offset) {
+	return command_be32(s->buffer + offset);
+}
+
+/*
+ * @brief  Assembles four bytes, MSB first, into a word
+ * @param  bytes
+ * @retval the word
+ */
+uint32_t command_be32(uint8_t *b) {
+	return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) |
+		   ((uint32_t)b[2] << 8) | (uint32_t)b[3];
 }
 
 /*
@@ -203,6 +598,9 @@ int32_t jumptoapp(uint32_t addr) {
 	/* Assign the function pointer. */
 	JumpToApp= (pFunction) JumpAddress;
 
+	/* Leave the device as out of reset, with the boot information. */
+	hil_handoff(addr, BLVERSION);
+
 	/* Initialize user application's Stack Pointer. */
 	__set_MSP(*(uint32_t*) addr);
 
@@ -215,377 +613,1545 @@ int32_t jumptoapp(uint32_t addr) {
 
 /* Protocol commands handlers ----------------------------------------------- */
 /* -------------------------------------------------------------------------- */
+/*
+ * @brief  Acknowledges the init byte
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccessful
+ */
+int32_t command_init(session_t *s) {
+	GPIOA->BSRR |= GPIO_BSRR_BS0 | GPIO_BSRR_BR1 | GPIO_BSRR_BR2 | GPIO_BSRR_BR3;
+	command_done(s);
+	cal_SENDACK(s->transport);
+	cal_SENDLOG("-> init byte received \r\n");
+	//NEED TO WRITE UNPROTECT SECTOR 1 (PAGES 0-3) AS THEY ARE AUTOMATICALLY WRITE PROTECTED
+	//START OFF WITH READ PROTECTION ACTIVE BY ERASING OPTION BYTES AS BULK
+	return 0;
+}
+
+/*
+ * @brief  Refuses an unknown command code or one with a wrong complement
+ * @param  session
+ * @retval -1
+ */
+int32_t command_nack(session_t *s) {
+	uint32_t i;
+
+	/* A known command code: its complement was wrong. */
+	for (i = 0; i < COMMAND_TABLE_SIZE; i++) {
+		if (command_table[i].opcode == s->opcode) cal_getstats(s->transport)->checksums++;
+	}
+	cal_SENDLOG("-> received command failed \r\n");
+	command_ABORT(s);
+}
+
 /*
  * @brief  Get commands implemented in the device side
- * @param  none
+ * @param  session
  * @retval 0 if successful
  * 		  -1 in unsuccseful
  */
-int32_t command_get_command() {
+int32_t command_get_command(session_t *s) {
+	uint8_t t = s->transport;
+	uint32_t i;
 	cal_SENDLOG("-> cmd: get command \r\n");
-	cal_SENDACK();
-	cal_SENDBYTE(0x0B);
-	cal_SENDBYTE(0x10);
-	cal_SENDBYTE(STM32_CMD_GET_COMMAND);
-	cal_SENDBYTE(STM32_CMD_GETVERSION_READPROTECTION);
-	cal_SENDBYTE(STM32_CMD_GET_ID);
-	cal_SENDBYTE(STM32_CMD_READ_MEMORY);
-	cal_SENDBYTE(STM32_CMD_GO);
-	cal_SENDBYTE(STM32_CMD_WRITE_MEMORY);
-	cal_SENDBYTE(STM32_CMD_ERASE);
-	cal_SENDBYTE(STM32_CMD_WRITE_PROTECT);
-	cal_SENDBYTE(STM32_CMD_WRITE_UNPROTECT);
-	cal_SENDBYTE(STM32_CMD_READOUT_PROTECT);
-	cal_SENDBYTE(STM32_CMD_READOUT_UNPROTECT);
-	cal_SENDACK();
+	command_done(s);
+	cal_SENDACK(t);
+	/* Number of bytes to follow - 1: version byte and command codes. */
+	cal_SENDBYTE(t, sizeof(command_advertised));
+	cal_SENDBYTE(t, 0x10);
+	for (i = 0; i < sizeof(command_advertised); i++) {
+		cal_SENDBYTE(t, command_advertised[i]);
+	}
+	cal_SENDACK(t);
 	cal_SENDLOG("\r\n-> cmd: get command terminated \r\n");
 	return 0;
 }
 
 /*
  * @brief  Get bootloader version and read protection status
- * @param  none
+ * @param  session
  * @retval 0 if successful
  * 		  -1 in unsuccessful
  */
-int32_t command_get_version() {
+int32_t command_get_version(session_t *s) {
+	uint8_t t = s->transport;
 	cal_SENDLOG("-> cmd: get version \r\n");
-	cal_SENDACK();
-	cal_SENDBYTE(BLVERSION);
-	cal_SENDBYTE(0x00);
-	cal_SENDBYTE(0x00);
-	cal_SENDACK();
+	command_done(s);
+	cal_SENDACK(t);
+	cal_SENDBYTE(t, BLVERSION);
+	cal_SENDBYTE(t, 0x00);
+	cal_SENDBYTE(t, 0x00);
+	cal_SENDACK(t);
 	cal_SENDLOG("-> cmd: get version terminated\r\n");
 	return 0;
 }
 
 /*
  * @brief  Get PID
- * @param  none
+ * @param  session
  * @retval 0 if successful
  * 		  -1 in unsuccessful
  */
-int32_t command_get_id() {
+int32_t command_get_id(session_t *s) {
+	uint8_t t = s->transport;
 	cal_SENDLOG("-> cmd: get ID \r\n");
-	cal_SENDACK();
-	cal_SENDBYTE(0x01);
-	cal_SENDBYTE(0x04);
-	cal_SENDBYTE(hil_getidbyte2());
-	cal_SENDACK();
+	command_done(s);
+	cal_SENDACK(t);
+	cal_SENDBYTE(t, 0x01);
+	cal_SENDBYTE(t, 0x04);
+	cal_SENDBYTE(t, hil_getidbyte2());
+	cal_SENDACK(t);
 	cal_SENDLOG("-> cmd: get ID terminated\r\n");
 	return 0;
 }
 
 /*
  * @brief  Read Device Memory
- * @param  none
+ * @param  session
  * @retval 0 if successful
  * 		  -1 in unsuccessful
+ *
+ * Phases: 1 address and its checksum, 2 number of bytes to read and its checksum;
+ * then the bytes are sent, COMMAND_STEPBYTES per step.
  */
-int32_t command_read_memory() {
-	cal_SENDLOG("-> cmd: read memory \r\n");
-	uint8_t checksum, number;
-	uint32_t addr, i;
-	uint32_t temp;
-
-	/* Check ROP. */
-	//if (hil_ropactive())  {cal_sendbyte(STM32_COMM_NACK); return -1;}
-	cal_SENDACK();
-
-	/* Receive and validate address. */
-	if(cal_receiveword((uint32_t *)&addr, TIMEOUT_NACK) == -1) return -1;  //data,address
-	if(cal_receivebyte((uint8_t *)&checksum, TIMEOUT_NACK) == -1) return -1;  //checksum
-	if(!hil_validateaddr(addr) == 1) {cal_sendbyte(STM32_COMM_NACK); return -1;}
-	if(checkchecksumword(addr,4,checksum) == -1) {cal_sendbyte(STM32_COMM_NACK); return -1;}
-	cal_SENDACK();
-
-	/* Receive number of bytes to read. */
-	if(cal_receivebyte((uint8_t *)&number, TIMEOUT_NACK) == -1) return -1;
-	if(cal_receivebyte((uint8_t *)&checksum, TIMEOUT_NACK) == -1) return -1;
-	if(checkchecksumbytes(&number,1,checksum) == -1) {cal_sendbyte(STM32_COMM_NACK); return -1;}
-	cal_SENDACK();
-
-    /* Send Data. */
-	/* Word-by-word as the returned value by hil_readFLASH */
-	for (i = 0;i < (number+1);i=i+4) {
-
-		temp = hil_readFLASH(addr+i);
-
-		/*
-		 * Need of delays found during debug
-		 * but is only needed for CAN transmission
-		 * when used with Pike's USB-CAN adapter
-		 * because of packet loss on the RX side
-		 * (guess is that the adapted does not keep up with such a fast packet burst)
-		 * Using Martino's CAN sniffer, no delays are needed
-		 */
-		cal_SENDBYTE(temp & 0xFF);
-		delay(999);
-		cal_SENDBYTE((temp>>8) & 0xFF);
-		delay(999);
-		cal_SENDBYTE((temp>>16) & 0xFF);
-		delay(999);
-		cal_SENDBYTE(temp>>24);
-		delay(999);
-
-    }
-	cal_SENDLOG("-> cmd: read memory terminated \r\n");
-	return 0;
+int32_t command_read_memory(session_t *s) {
+	uint8_t t = s->transport;
+	uint32_t i, n, temp = 0;
+
+	switch (s->phase) {
+		case 0 :
+			cal_SENDLOG("-> cmd: read memory \r\n");
+			/* Check ROP. */
+			//if (hil_ropactive())  {command_ABORT(s);}
+			command_expect(s, 5);
+			cal_SENDACK(t);
+			return 0;
+
+		case 1 :
+			/* Validate address. */
+			s->addr = command_getword(s, 0);
+			if (command_badsum(s, s->checksum) || hil_validateaddr(s->addr) == -1) {command_ABORT(s);}
+			command_expect(s, 2);
+			cal_SENDACK(t);
+			return 0;
+
+		case 2 :
+			/* Validate number of bytes to read. */
+			if (command_badsum(s, s->checksum)) {command_ABORT(s);}
+			s->number = s->buffer[0];
+			s->offset = 0;
+			command_continue(s, 3);
+			cal_SENDACK(t);
+			return 0;
+
+		default :
+			/* Send Data, COMMAND_STEPBYTES per step. */
+			n = s->offset + COMMAND_STEPBYTES;
+			if (n >= (uint32_t)s->number+1) {
+				n = (uint32_t)s->number+1;
+				command_done(s);
+			}
+
+			/* Word-by-word as the returned value by hil_readFLASH */
+			for (i = s->offset; i < n; i++) {
+
+				if ((i & 0x3) == 0) temp = hil_readFLASH(s->addr+i);
+
+				/*
+				 * Need of delays found during debug
+				 * but is only needed for CAN transmission
+				 * when used with Pike's USB-CAN adapter
+				 * because of packet loss on the RX side
+				 * (guess is that the adapted does not keep up with such a fast packet burst)
+				 * Using Martino's CAN sniffer, no delays are needed
+				 */
+				cal_SENDBYTE(t, temp & 0xFF);
+				if (t == CAL_CAN) hil_delayus(COMMAND_CANGAP);
+				temp >>= 8;
+			}
+			s->offset = n;
+			if (n == (uint32_t)s->number+1) cal_SENDLOG("-> cmd: read memory terminated \r\n");
+			return 0;
+	}
 }
 
 /*
  * @brief  Go executing the application code
- * @param  none
+ * @param  session
  * @retval 0 if successful
  * 		  -1 in unsuccessful
  * Return 2 ACK or 1 ACK? Refer to ST's AN3155 for this ambiguity
  */
-int32_t command_go() {
-	uint8_t checksum;
-	uint32_t addr;
-	//if (hil_ropactive())  {cal_sendbyte(STM32_COMM_NACK); return -1;}
-	cal_SENDACK();
+int32_t command_go(session_t *s) {
+	uint8_t t = s->transport;
 
-	/* Receive address and its checksum and validate it. */
-	cal_READWORD(addr,TIMEOUT_NACK);
-	cal_READBYTE(checksum,TIMEOUT_NACK); //checksum
-	if(checkchecksumword(addr,4,checksum) == -1) {cal_SENDNACK();}
-	if(!hil_validateaddr(addr) == 1) {cal_SENDNACK();}
-	cal_SENDACK();
+	switch (s->phase) {
+		case 0 :
+			//if (hil_ropactive())  {command_ABORT(s);}
+			/* Do not run an image whose last blocks failed to program. */
+			if (command_job.error) {
+				command_job.error = 0;
+				command_ABORT(s);
+			}
+			command_expect(s, 5);
+			cal_SENDACK(t);
+			return 0;
 
-	//cal_SENDACK();
+		default :
+			/* Validate address and its checksum. */
+			s->addr = command_getword(s, 0);
+			if (command_badsum(s, s->checksum) || hil_validateaddr(s->addr) == -1) {command_ABORT(s);}
+			command_done(s);
+			cal_SENDACK(t);
 
-	/* Jump! */
-	jumptoapp(addr);
+			/* The application gets no bootloader interrupt. */
+			for (t = 1; t <= CAL_TRANSPORTS; t++) cal_disableinterrupt(t);
 
-	return 0;
+			/* Jump! */
+			jumptoapp(s->addr);
+			return 0;
+	}
 }
 
 /*
  * @brief  Write device memory
- * @param  none
+ * @param  session
  * @retval 0 if successful
  * 		  -1 in unsuccseful
+ *
+ * Phases: 1 address and its checksum, 2 number of bytes, 3 data and checksum.
  */
-int32_t command_write_memory() {
-
-	uint32_t addr;
-	uint8_t number, checksum;
-	uint8_t bytes[4] = {0, 0, 0, 0};
-	uint32_t i, j;
-
-	//if (hil_ropactive())  {cal_sendbyte(STM32_COMM_NACK); return -1;}
-	cal_SENDACK();
-
-	/* Receive address. */
-	cal_READWORD(addr,TIMEOUT_NACK);
-	cal_READBYTE(checksum,TIMEOUT_NACK);
-	if(checkchecksumword(addr,4,checksum) == -1) {cal_SENDNACK();}
-	cal_SENDACK();
-
-	/* Receive data packet. */
-	/* it is actually number + 1 to be received according to the docs
-     * expecting nummber+1 bytes, and add one place to append number itself at the end
-     * range: 0 - number+1, places available: number+2
-     */
-	cal_READBYTE(number, TIMEOUT_NACK);
-	uint8_t databuffer[number+2];
-	for(i=0;i<number+1;i++) {
-		if(cal_receivebyte(databuffer+i, TIMEOUT_NACK)) return -1; //41 41 a
-	}
-	databuffer[number+1]=number;
-	cal_READBYTE(checksum,TIMEOUT_NACK);
-	if(checkchecksumbytes(databuffer,number+2,checksum)==-1) {cal_SENDNACK();}
-	else {
-		switch (hil_validateaddr(addr)) {
-			case 1:  //case FLASH
-				for (j=0;j<(number+1);j=j+4) {
-					for (i=0; (i<4 && (j+i)<=number); i++) {
-						bytes[i]=databuffer[j+i];
+int32_t command_write_memory(session_t *s) {
+	uint8_t t = s->transport;
+	uint8_t *block;
+	uint32_t n;
+
+	switch (s->phase) {
+		case 0 :
+			//if (hil_ropactive())  {command_ABORT(s);}
+			/* An already ACKed block that failed to program fails the next write. */
+			if (command_job.error) {
+				command_job.error = 0;
+				command_ABORT(s);
+			}
+			command_expect(s, 5);
+			cal_SENDACK(t);
+			return 0;
+
+		case 1 :
+			/* Validate address. */
+			s->addr = command_getword(s, 0);
+			if (command_badsum(s, s->checksum)) {command_ABORT(s);}
+			if (hil_validateaddr(s->addr) != 0 && command_claimflash(s) == -1) {command_ABORT(s);}
+			command_expect(s, 1);
+			cal_SENDACK(t);
+			return 0;
+
+		case 2 :
+			/* Data packet follows the number with no ACK in between.
+			 * it is actually number + 1 to be received according to the docs,
+			 * followed by the checksum of number and data
+			 */
+			s->number = s->buffer[0];
+			command_expect(s, s->number + 2);
+			return 0;
+
+		default :
+			if (command_badsum(s, s->checksum ^ s->number)) {command_ABORT(s);}
+			n = (uint32_t)s->number+1;
+			switch (hil_validateaddr(s->addr)) {
+				case 1:  //case FLASH
+					if (hil_validateaddr(s->addr+n-1) != 1) {command_ABORT(s);}
+
+					/* Unaligned or odd-length blocks, and blocks touching the staged
+					 * page, are merged into it and written when another page is
+					 * addressed or before any other command. */
+					if (((s->addr | n) & 0x3) != 0 || (command_stagedpage != COMMAND_NOPAGE &&
+						s->addr < command_stagedpage + FLASHPAGESIZE && s->addr + n > command_stagedpage)) {
+						if (command_combine(s->addr, s->buffer, n) == -1) {command_ABORT(s);}
+						command_done(s);
+						cal_SENDACK(t);
+						break;
 					}
-				FLASH_ProgramWord(addr+j,*(uint32_t*)bytes);
-				}
-				cal_SENDACK();
-				break;
-			case 0:  //case RAM
-				//UNTESTED
-				for (j=0;j<number+1;j++) {
-				*(&addr+j)=*(databuffer+j);
-				}
-				break;
-			default: //case option bytes
-				//UNTESTED
-				if(addr==0x1FFFF800) {
-					FLASH_ProgramOptionByteData(addr, *databuffer);
-					if(cal_sendbyte(STM32_COMM_ACK)==-1) return -1;
-					hil_reset();
+
+					/* Hand the block to the program job and collect the next one
+					 * in the spare buffer. */
+					block = s->buffer;
+					s->buffer = s->spare;
+					s->spare = block;
+					command_job.addr = s->addr;
+					command_job.data = block;
+					command_job.length = n;
+					command_done(s);
+					cal_SENDACK(t);
 					break;
-				}
-			else {
-				cal_SENDNACK();
-				return -1;
+				case 0:  //case RAM
+					//UNTESTED
+					if (s->addr + n > RAMtop) {command_ABORT(s);}
+					for (n=0;n<(uint32_t)s->number+1;n++) {
+						*((uint8_t*)s->addr+n)=s->buffer[n];
+					}
+					command_done(s);
+					cal_SENDACK(t);
+					break;
+				default: //case option bytes
+					//UNTESTED
+#ifndef CBBL_AGENT
+					if(s->addr==0x1FFFF800) {
+						FLASH_ProgramOptionByteData(s->addr, s->buffer[0]);
+						command_done(s);
+						cal_SENDACK(t);
+						command_reset(s);
+						break;
+					}
+					else
+#endif
+					{
+						command_ABORT(s);
+					}
 			}
-		}
+			return 0;
 	}
-	return 0;
 }
 
 /*
  * @brief  Erase device memory
- * @param  none
+ * @param  session
  * @retval 0 if successful
  * 		  -1 in unsuccseful
+ *
+ * Phases: 1 number of pages, 2 page codes and checksum, or the 0x00 checksum of a global erase;
+ * then a page is erased per step. A global erase erases the inactive slot (see slot.h).
  */
-int32_t command_erase() {
-	uint8_t number, checksum;
-	uint32_t pageaddr;
-	uint8_t i;
-
-	cal_SENDLOG("-> cmd: erase memory started, acking \r\n");
-	//if (hil_ropactive())  {cal_sendbyte(STM32_COMM_NACK); return -1;}
-	cal_SENDACK();
+int32_t command_erase(session_t *s) {
+	uint8_t t = s->transport;
 
-	/* Read number of pages to be erased. */
-	cal_READBYTE(number, TIMEOUT_NACK);
+	switch (s->phase) {
+		case 0 :
+			cal_SENDLOG("-> cmd: erase memory started, acking \r\n");
+			//if (hil_ropactive())  {command_ABORT(s);}
+			if (command_claimflash(s) == -1) {command_ABORT(s);}
+			command_expect(s, 1);
+			cal_SENDACK(t);
+			return 0;
 
-	/* If global erase. */
-	if (number==0xFF) {
-		cal_SENDLOG("-> cmd: global erase requested, starting global erase \r\n");
-		hil_globalerasememory();
-		cal_SENDLOG("-> cmd: global erase terminated, acking \r\n");
-		cal_SENDACK();
-		else return 0;
-	}
+		case 1 :
+			/* Read number of pages to be erased. */
+			s->number = s->buffer[0];
+			if (s->number == 0xFF) command_expect(s, 1);
+			else command_expect(s, s->number + 2);
+			return 0;
 
-	/* If pagewise erase. */
-	else {
+		case 2 :
+			/* If global erase. */
+			if (s->number == 0xFF) {
+				if (s->buffer[0] != 0x00) {command_ABORT(s);}
+				cal_SENDLOG("-> cmd: global erase requested, starting global erase \r\n");
+				s->addr = slot_inactivebase();
+				s->length = s->addr + SLOT_IMAGESIZE;
+				command_continue(s, 3);
+				return 0;
+			}
 
+			/* If pagewise erase. */
 			//UNTESTED!
-
 			cal_SENDLOG("-> cmd: pagewise erase requested \r\n");
-			uint8_t databuffer[number+2];
-			for(i=0;i<number+1;i++) {
-				if(cal_receivebyte(databuffer+i, TIMEOUT_NACK)) return -1;//receive page codes
-			}
-			databuffer[number+1]=number;
-			cal_READBYTE(checksum, TIMEOUT_NACK);
-			if(checkchecksumbytes(databuffer,number+2,checksum)==-1) cal_SENDNACK();
+			if (command_badsum(s, s->checksum ^ s->number)) {command_ABORT(s);}
 			cal_SENDLOG("-> cmd: checksum correct, starting pagewise erase \r\n");
-			for (i=0;i<number+1;i++) {
-			   pageaddr = (databuffer[i]-1)*FLASHPAGESIZE+FLASHbase;
-			   FLASH_ErasePage(pageaddr);
-			}
+			s->offset = 0;
+			command_continue(s, 4);
+			return 0;
+
+		case 3 :
+			/* Global erase, next page. */
+			if (command_erasepage(s->addr) == -1) {command_ABORT(s);}
+			s->addr += FLASHPAGESIZE;
+			if (s->addr < s->length) return 0;
+			cal_SENDLOG("-> cmd: global erase terminated, acking \r\n");
+			command_done(s);
+			cal_SENDACK(t);
+			return 0;
+
+		default :
+			/* Pagewise erase, next page code. */
+			if (command_erasepage(COMMAND_PAGEADDR(s->buffer[s->offset])) == -1) {command_ABORT(s);}
+			if (++s->offset <= s->number) return 0;
 			cal_SENDLOG("-> cmd: pagewise erase terminated, acking \r\n");
-			cal_SENDACK();
-		}
-	return 0;
+			command_done(s);
+			cal_SENDACK(t);
+			return 0;
+	}
+}
+
+/*
+ * @brief  Erases a page for an erase command, one per handler step
+ * @param  base address of the page
+ * @retval 0 if successful
+ * 		  -1 if not successful
+ */
+int32_t command_erasepage(uint32_t page) {
+	int32_t result;
+
+	PROFILE_START(PROFILE_FLASH);
+	result = hil_erasecorrespondingpage(page);
+	PROFILE_STOP(PROFILE_FLASH);
+	return result;
 }
 
 
 //DOES NOT HAVE TO BE IMPLEMENTED MANDATORILY. Erase and Extended Erase commands are mutually exclusive
 //UNTESTED
-int32_t command_extended_erase() {
-	uint16_t *q = 0x0000;
-	if (hil_ropactive())  {cal_sendbyte(STM32_COMM_NACK); return -1;}
-	if(cal_sendbyte(STM32_COMM_ACK)==-1) return -1;
-	//receive 2 bytes
-	switch (*q) {
-	case 0xFFFF:
-		//receive checksum 2 bytes
-		//check it
-		//yes
-		hil_globalerasememory();
-		if(cal_sendbyte(STM32_COMM_ACK)==-1) return -1;
-		//NO
-		if(cal_sendbyte(STM32_COMM_NACK)==-1) return -1;
-		    break;
-	case 0xFFFE:
-		//receive checksum 2 bytes
-		//check it
-		//yes
-		hil_erasebank1();
-		if(cal_sendbyte(STM32_COMM_ACK)==-1) return -1;
-		//NO
-		if(cal_sendbyte(STM32_COMM_NACK)==-1) return -1;
-			break;
-	case 0xFFFD:
-		//receive checksum 2 bytes
-		//check it
-		//yes
-		hil_erasebank2();
-		if(cal_sendbyte(STM32_COMM_ACK)==-1) return -1;
-		//NO
-		if(cal_sendbyte(STM32_COMM_NACK)==-1) return -1;
-			break;
-	default:
-		//receive page codes and checksum
-		//checksum ok
-		//no
-		if(cal_sendbyte(STM32_COMM_NACK)==-1) return -1;
-		//yes
-		hil_erasecorrespondingpage(0xFFFF);
-		if(cal_sendbyte(STM32_COMM_ACK)==-1) return -1;
-		break;
+/*
+ * @brief  Extended erase, 16-bit page numbers counted from the start of the FLASH
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phases: 1 two bytes N (MSB first), 2 checksum of a special erase, or page numbers and checksum;
+ * then a page is erased per step. N is kept in s->addr, the next page in s->offset.
+ */
+int32_t command_extended_erase(session_t *s) {
+	uint8_t t = s->transport;
+	uint32_t page;
+
+	switch (s->phase) {
+		case 0 :
+			if (hil_ropactive())  {command_ABORT(s);}
+			if (command_claimflash(s) == -1) {command_ABORT(s);}
+			command_expect(s, 2);
+			cal_SENDACK(t);
+			return 0;
+
+		case 1 :
+			s->addr = ((uint32_t)s->buffer[0] << 8) | s->buffer[1];
+			if (s->addr >= 0xFFFD) command_expect(s, 1);
+			else if ((s->addr+1)*2+1 <= SESSION_BUFSIZE) command_expect(s, (s->addr+1)*2+1);
+			else {command_ABORT(s);}
+			return 0;
+
+		case 2 :
+			if (command_badsum(s, s->checksum ^ (s->addr >> 8) ^ (s->addr & 0xFF))) {command_ABORT(s);}
+			switch (s->addr) {
+				case 0xFFFF:
+					/* The inactive slot, see slot.h. */
+					s->offset = slot_inactivebase();
+					s->length = s->offset + SLOT_IMAGESIZE;
+					break;
+				case 0xFFFE:
+					/* What hil_erasebank1() erases. */
+					hil_getflashrange(&s->offset, &s->length);
+					s->length++;
+					break;
+				case 0xFFFD:
+					if (hil_erasebank2() == -1) {command_ABORT(s);}
+					command_done(s);
+					cal_SENDACK(t);
+					return 0;
+				default:
+					s->offset = 0;
+					command_continue(s, 4);
+					return 0;
+			}
+			command_continue(s, 3);
+			return 0;
+
+		case 3 :
+			/* Mass erase, next page. */
+			if (command_erasepage(s->offset) == -1) {command_ABORT(s);}
+			s->offset += FLASHPAGESIZE;
+			if (s->offset < s->length) return 0;
+			command_done(s);
+			cal_SENDACK(t);
+			return 0;
+
+		default :
+			/* Next page number. */
+			page = ((uint32_t)s->buffer[2*s->offset] << 8) | s->buffer[2*s->offset+1];
+			if (command_erasepage(COMMAND_PAGEADDR(page)) == -1) {command_ABORT(s);}
+			if (++s->offset <= s->addr) return 0;
+			command_done(s);
+			cal_SENDACK(t);
+			return 0;
 	}
-	return 0;
 }
 
 // UNTESTED
-int32_t command_write_protect() {
-	uint8_t number;
-	uint8_t checksum ;
-	uint8_t i;
+/*
+ * Phases: 1 number of sectors, 2 sector codes and checksum.
+ */
+int32_t command_write_protect(session_t *s) {
+	uint8_t t = s->transport;
+	uint32_t i;
 	uint32_t sector;
-	if (hil_ropactive())  {cal_sendbyte(STM32_COMM_NACK); return -1;}
-	if(cal_sendbyte(STM32_COMM_ACK)==-1) return -1;
-	cal_receivebyte((uint8_t *)&number, TIMEOUT_NACK); //number of sectors to be protected (1 byte)
-	uint8_t databuffer[number+2];  //sector code
-	for(i=0;i<number+1;i++) {
-		if(cal_receivebyte(databuffer+i, TIMEOUT_NACK)) return -1;//receive sector codes
-	}
-	databuffer[number+1]=number;
-	if(cal_receivebyte((uint8_t *)&checksum, TIMEOUT_NACK) == -1) return -1;
-	if(checkchecksumbytes(databuffer,number+2,checksum)==-1) {cal_sendbyte(STM32_COMM_NACK); return -1;};
-	for (i=0;i<number+1;i++) {
-    sector = (databuffer[i]-1)*SECTORSIZE+FLASHbase;   //what is sector codes received. this calculation might be wrong
-    hil_enablewriteprotectionflashmen(sector);
-	}
-	if(cal_sendbyte(STM32_COMM_ACK)==-1) return -1;
-	hil_reset();
-	return 0;
+
+	switch (s->phase) {
+		case 0 :
+			if (hil_ropactive())  {command_ABORT(s);}
+			if (command_claimflash(s) == -1) {command_ABORT(s);}
+			command_expect(s, 1);
+			cal_SENDACK(t);
+			return 0;
+
+		case 1 :
+			s->number = s->buffer[0]; //number of sectors to be protected (1 byte)
+			command_expect(s, s->number + 2);
+			return 0;
+
+		default :
+			if (command_badsum(s, s->checksum ^ s->number)) {command_ABORT(s);}
+			for (i=0;i<(uint32_t)s->number+1;i++) {
+				sector = (s->buffer[i]-1)*SECTORSIZE+FLASHbase;   //what is sector codes received. this calculation might be wrong
+				hil_enablewriteprotectionflashmen(sector);
+			}
+			command_done(s);
+			cal_SENDACK(t);
+			command_reset(s);
+			return 0;
+	}
 }
 
 //UNTESTED
-int32_t command_write_unprotect() {
-	//if (hil_ropactive())  {cal_sendbyte(STM32_COMM_NACK); return -1;}
+int32_t command_write_unprotect(session_t *s) {
+	uint8_t t = s->transport;
+	//if (hil_ropactive())  {command_ABORT(s);}
+	if (command_claimflash(s) == -1) {command_ABORT(s);}
 	cal_SENDLOG("-> cmd: write unprotect entered, acking \r\n");
-	cal_SENDACK();
+	command_done(s);
+	cal_SENDACK(t);
 	hil_removewriteprotectionflashmem();
 	cal_SENDLOG("-> cmd: write protection removed, acking \r\n");
-	cal_SENDACK();
+	cal_SENDACK(t);
 	cal_SENDLOG("-> cmd: write unprotect ended, generating system reset \r\n");
-	hil_reset();
+	command_reset(s);
 	return 0;
 }
 
 //UNTESTED
-int32_t command_readout_protect() {
-	if (hil_ropactive())  {cal_sendbyte(STM32_COMM_NACK); return -1;}
-	if(cal_sendbyte(STM32_COMM_ACK)==-1) return -1;
+int32_t command_readout_protect(session_t *s) {
+	uint8_t t = s->transport;
+	if (hil_ropactive())  {command_ABORT(s);}
+	if (command_claimflash(s) == -1) {command_ABORT(s);}
+	command_done(s);
+	cal_SENDACK(t);
 	hil_enablerop();
-	if(cal_sendbyte(STM32_COMM_ACK)==-1) return -1;
-	hil_reset();
+	cal_SENDACK(t);
+	command_reset(s);
 	return 0;
 }
 
 //UNTESTED
-int32_t command_readout_unprotect() {
-	if(cal_sendbyte(STM32_COMM_ACK)==-1) return -1;
+int32_t command_readout_unprotect(session_t *s) {
+	uint8_t t = s->transport;
+	if (command_claimflash(s) == -1) {command_ABORT(s);}
+	command_done(s);
+	cal_SENDACK(t);
 	hil_disablerop();//Flash Mass Erased :(
-	if(cal_sendbyte(STM32_COMM_ACK)==-1) return -1;
+	cal_SENDACK(t);
 	hil_clearram();
-	hil_reset();
+	command_reset(s);
 	return 0;
 }
 
+/* Vendor commands handlers ------------------------------------------------- */
+/* -------------------------------------------------------------------------- */
+/*
+ * @brief  Write whole FLASH pages, skipping the unchanged ones
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phases: 1 page-aligned address, number of pages - 1 and checksum, then for
+ * every block 2 number of bytes and 3 data and checksum, as in write memory.
+ * Blocks are staged until a page is complete; blocks may not straddle pages.
+ * Each block is ACKed; the ACK of a block completing a page is followed by
+ * the page outcome: HIL_PAGE_SKIPPED, HIL_PAGE_PROGRAMMED or HIL_PAGE_ERASED.
+ */
+int32_t command_write_changed(session_t *s) {
+	uint8_t t = s->transport;
+	int32_t outcome = -1;
+	uint32_t i, n;
+
+	switch (s->phase) {
+		case 0 :
+			//if (hil_ropactive())  {command_ABORT(s);}
+			if (command_claimflash(s) == -1) {command_ABORT(s);}
+			command_expect(s, 6);
+			cal_SENDACK(t);
+			return 0;
+
+		case 1 :
+			s->addr = command_getword(s, 0);
+			s->length = ((uint32_t)s->buffer[4] + 1) * FLASHPAGESIZE;
+			s->offset = 0;
+			if (command_badsum(s, s->checksum) || (s->addr & (FLASHPAGESIZE-1)) != 0 ||
+				hil_validateaddr(s->addr) != 1 || hil_validateaddr(s->addr + s->length - 1) != 1) {command_ABORT(s);}
+			command_expect(s, 1);
+			cal_SENDACK(t);
+			return 0;
+
+		case 2 :
+			s->number = s->buffer[0];
+			command_expect(s, s->number + 2);
+			return 0;
+
+		default :
+			n = (uint32_t)s->number + 1;
+			if (command_badsum(s, s->checksum ^ s->number) || n > FLASHPAGESIZE - s->offset) {command_ABORT(s);}
+			for (i = 0; i < n; i++) ((uint8_t*)command_stagingpage)[s->offset + i] = s->buffer[i];
+			s->offset += n;
+			s->length -= n;
+
+			/* Page complete. */
+			if (s->offset == FLASHPAGESIZE) {
+				PROFILE_START(PROFILE_FLASH);
+				outcome = hil_writepage(s->addr, command_stagingpage);
+				PROFILE_STOP(PROFILE_FLASH);
+				if (outcome == -1) {command_ABORT(s);}
+				s->addr += FLASHPAGESIZE;
+				s->offset = 0;
+			}
+
+			if (s->length == 0) command_done(s);
+			else {
+				s->phase = 1;
+				command_expect(s, 1);
+			}
+			cal_SENDACK(t);
+			if (outcome != -1) {cal_SENDBYTE(t, (uint8_t)outcome);}
+			return 0;
+	}
+}
+
+/*
+ * @brief  Send the CRC-32 (hil_crc32()) of every page of a range, so that the host
+ *         only sends the pages that differ
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phase 1: page-aligned address, number of pages - 1 and checksum.
+ * Reply: ACK, one CRC per page MSB first, ACK; a CRC is sent per step.
+ */
+int32_t command_page_hashes(session_t *s) {
+	uint8_t t = s->transport;
+	uint32_t crc;
+
+	switch (s->phase) {
+		case 0 :
+			//if (hil_ropactive())  {command_ABORT(s);}
+			command_expect(s, 6);
+			cal_SENDACK(t);
+			return 0;
+
+		case 1 :
+			s->addr = command_getword(s, 0);
+			s->length = ((uint32_t)s->buffer[4] + 1) * FLASHPAGESIZE;
+			if (command_badsum(s, s->checksum) || (s->addr & (FLASHPAGESIZE-1)) != 0 ||
+				hil_validateaddr(s->addr) != 1 || hil_validateaddr(s->addr + s->length - 1) != 1) {command_ABORT(s);}
+			s->offset = 0;
+			command_continue(s, 2);
+			cal_SENDACK(t);
+			return 0;
+
+		default :
+			/* Next page. */
+			crc = hil_crc32(s->addr + s->offset, FLASHPAGESIZE);
+			s->offset += FLASHPAGESIZE;
+			if (s->offset == s->length) command_done(s);
+			cal_SENDWORD(t, crc);
+			if (s->offset == s->length) cal_SENDACK(t);
+			return 0;
+	}
+}
+
+/*
+ * @brief  Verify a memory range against the CRC-32 expected by the host,
+ *         replacing a full read back
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phase 1: word-aligned address, length in bytes (multiple of 4), expected
+ * CRC-32 (as hil_crc32()), each MSB first, and checksum of the 12 bytes.
+ * Reply: ACK once the arguments are valid, then ACK if the CRC matches or NACK
+ * if not, followed by the computed CRC MSB first.
+ */
+int32_t command_verify_crc(session_t *s) {
+	uint8_t t = s->transport;
+	uint32_t crc, expected;
+
+	switch (s->phase) {
+		case 0 :
+			//if (hil_ropactive())  {command_ABORT(s);}
+			command_expect(s, 13);
+			cal_SENDACK(t);
+			return 0;
+
+		default :
+			s->addr = command_getword(s, 0);
+			s->length = command_getword(s, 4);
+			expected = command_getword(s, 8);
+			if (command_badsum(s, s->checksum) || s->length == 0 || ((s->addr | s->length) & 0x3) != 0 ||
+				s->addr + s->length - 1 < s->addr || hil_validateaddr(s->addr) == -1 ||
+				hil_validateaddr(s->addr + s->length - 1) != hil_validateaddr(s->addr)) {command_ABORT(s);}
+			command_done(s);
+			cal_SENDACK(t);
+			crc = hil_crc32(s->addr, s->length);
+			cal_SENDBYTE(t, (crc == expected) ? STM32_COMM_ACK : STM32_COMM_NACK);
+			cal_SENDWORD(t, crc);
+			return 0;
+	}
+}
+
+/*
+ * @brief  Fill a FLASH range with a 32-bit pattern (hil_fill()), for the runs of
+ *         filler of sparse images
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phase 1: word-aligned address, length in bytes (multiple of 4) and pattern,
+ * each MSB first, and checksum of the 12 bytes; then the range is filled up to
+ * a page boundary per step, the pattern being kept in s->offset.
+ * Reply: ACK once filled, NACK if the arguments are not valid or the fill failed.
+ */
+int32_t command_fill(session_t *s) {
+	uint8_t t = s->transport;
+	uint32_t n;
+
+	switch (s->phase) {
+		case 0 :
+			//if (hil_ropactive())  {command_ABORT(s);}
+			if (command_claimflash(s) == -1) {command_ABORT(s);}
+			command_expect(s, 13);
+			cal_SENDACK(t);
+			return 0;
+
+		case 1 :
+			s->addr = command_getword(s, 0);
+			s->length = command_getword(s, 4);
+			s->offset = command_getword(s, 8);
+			if (command_badsum(s, s->checksum) || s->length == 0 || ((s->addr | s->length) & 0x3) != 0 ||
+				s->addr + s->length - 1 < s->addr ||
+				hil_validateaddr(s->addr) != 1 || hil_validateaddr(s->addr + s->length - 1) != 1) {command_ABORT(s);}
+			command_continue(s, 2);
+			return 0;
+
+		default :
+			/* Up to the end of the page. */
+			n = ((s->addr | (FLASHPAGESIZE-1)) + 1) - s->addr;
+			if (n > s->length) n = s->length;
+			if (hil_fill(s->addr, n, s->offset) == -1) {command_ABORT(s);}
+			s->addr += n;
+			s->length -= n;
+			if (s->length != 0) return 0;
+			command_done(s);
+			cal_SENDACK(t);
+			return 0;
+	}
+}
+
+/*
+ * @brief  Dump a FLASH range for forensics, sending only the non-blank pages and
+ *         those RLE-compressed (command_rle())
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phase 1: page-aligned address, length in bytes (multiple of FLASHPAGESIZE),
+ * each MSB first, and checksum of the 8 bytes.
+ * Reply: ACK; 16-bit number of non-blank ranges then address and length of each
+ * (a blank page is all 0xFF); then the contents of the ranges, in order, as
+ * frames of N-1 (1 byte), N bytes of RLE stream (no token straddles a frame
+ * nor a range) and XOR of the N-1 byte and the N bytes; ACK.
+ * Frames are built in the two session buffers in turn: one is compressed
+ * into while the other is being sent (by DMA on USART).
+ * Steps: 2 maps a page, 3 sends a range, then a frame is sent per step.
+ */
+int32_t command_dump(session_t *s) {
+	uint8_t t = s->transport;
+	dumprun_t *d = &command_dumpruns[t-1];
+	uint32_t i, n;
+
+	switch (s->phase) {
+		case 0 :
+			//if (hil_ropactive())  {command_ABORT(s);}
+			command_expect(s, 9);
+			cal_SENDACK(t);
+			return 0;
+
+		case 1 :
+			s->addr = command_getword(s, 0);
+			s->length = command_getword(s, 4);
+			if (command_badsum(s, s->checksum) || s->length == 0 || ((s->addr | s->length) & (FLASHPAGESIZE-1)) != 0 ||
+				s->length / FLASHPAGESIZE > 256 ||
+				hil_validateaddr(s->addr) != 1 || hil_validateaddr(s->addr + s->length - 1) != 1) {command_ABORT(s);}
+			d->page = 0;
+			d->ranges = 0;
+			command_continue(s, 2);
+			cal_SENDACK(t);
+			return 0;
+
+		case 2 :
+			/* Map of the blank pages, and number of non-blank ranges. */
+			i = d->page++;
+			if (command_blankpage(s->addr + i*FLASHPAGESIZE)) d->blank[i/32] |= 1 << (i%32);
+			else {
+				d->blank[i/32] &= ~(1 << (i%32));
+				if (i == 0 || (d->blank[(i-1)/32] & (1 << ((i-1)%32)))) d->ranges++;
+			}
+			if (d->page < s->length / FLASHPAGESIZE) return 0;
+			d->page = 0;
+			command_continue(s, 3);
+			cal_SENDBYTE(t, d->ranges >> 8);
+			cal_SENDBYTE(t, d->ranges & 0xFF);
+			return 0;
+
+		case 3 :
+			/* Ranges, then their contents; both walk the map the same way. */
+			if (command_dumprange(s, d)) {
+				cal_SENDWORD(t, d->src);
+				cal_SENDWORD(t, d->end - d->src);
+				return 0;
+			}
+			d->page = 0;
+			d->src = 0;
+			d->end = 0;
+			d->frame = s->buffer;
+			command_continue(s, 4);
+			return 0;
+
+		default :
+			if (d->src == d->end && command_dumprange(s, d) == 0) {
+				command_done(s);
+				cal_waitblock(t);
+				cal_SENDACK(t);
+				return 0;
+			}
+			n = command_rle(&d->src, d->end, d->frame + 1, 256);
+			d->frame[0] = n - 1;
+			d->frame[n + 1] = calculatechecksum(d->frame, n + 1);
+			if (cal_sendblock(t, d->frame, n + 2) == -1) {command_done(s); return -1;}
+			/* Swap: compress into the other buffer while this one is sent. */
+			d->frame = (d->frame == s->buffer) ? s->spare : s->buffer;
+			return 0;
+	}
+}
+
+/*
+ * @brief  Finds the next non-blank range of a dump, see command_dump()
+ * @param  session, its dump (map of the blank pages, page to look from)
+ * @retval 1 if found, in d->src and d->end, d->page past it
+ * 		   0 if none left
+ */
+int32_t command_dumprange(session_t *s, dumprun_t *d) {
+	uint32_t pages = s->length / FLASHPAGESIZE;
+
+	while (d->page < pages && (d->blank[d->page/32] & (1 << (d->page%32)))) d->page++;
+	if (d->page == pages) return 0;
+	d->src = s->addr + d->page*FLASHPAGESIZE;
+	while (d->page < pages && !(d->blank[d->page/32] & (1 << (d->page%32)))) d->page++;
+	d->end = s->addr + d->page*FLASHPAGESIZE;
+	return 1;
+}
+
+/*
+ * @brief  Queries and updates the update progress journal, so that a dropped
+ *         session resumes from the first page not verified yet
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phase 1: operation (JOURNAL_OP_*), three words of arguments, MSB first, unused
+ * ones sent as 0, and checksum of the 13 bytes.
+ * Reply: ACK; ACK if the operation succeeded, NACK if not; then the image ID, the
+ * first page not verified and the number of verified pages, each MSB first.
+ */
+int32_t command_journal(session_t *s) {
+	uint8_t t = s->transport;
+	int32_t result = 0;
+
+	switch (s->phase) {
+		case 0 :
+			//if (hil_ropactive())  {command_ABORT(s);}
+			command_expect(s, 14);
+			cal_SENDACK(t);
+			return 0;
+
+		default :
+			if (command_badsum(s, s->checksum) || s->buffer[0] > JOURNAL_OP_COMMIT) {command_ABORT(s);}
+			if (s->buffer[0] != JOURNAL_OP_QUERY && command_claimflash(s) == -1) {command_ABORT(s);}
+			command_done(s);
+			cal_SENDACK(t);
+
+			switch (s->buffer[0]) {
+				case JOURNAL_OP_OPEN :
+					result = journal_open(command_getword(s, 1));
+					break;
+				case JOURNAL_OP_COMMIT :
+					result = journal_commit(command_getword(s, 1), command_getword(s, 5), command_getword(s, 9));
+					break;
+				default :
+					journal_load();
+					break;
+			}
+			if (result == -1) {cal_SENDNACK(t);}
+			else {cal_SENDACK(t);}
+			cal_SENDWORD(t, journal_image());
+			cal_SENDWORD(t, journal_firstincomplete());
+			cal_SENDWORD(t, journal_verified());
+			return 0;
+	}
+}
+
+/*
+ * @brief  Queries the application slots and activates the inactive one once written
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phase 1: operation (SLOT_OP_*), three words of arguments, MSB first, unused
+ * ones sent as 0, and checksum of the 13 bytes.
+ * Reply: ACK; ACK if the operation succeeded, NACK if not; then the base address
+ * of the active slot, of the inactive slot (where a new image goes), the slot size
+ * and the boots not confirmed by the application, each MSB first.
+ */
+int32_t command_slot(session_t *s) {
+	uint8_t t = s->transport;
+	int32_t result = 0;
+
+	switch (s->phase) {
+		case 0 :
+			//if (hil_ropactive())  {command_ABORT(s);}
+			command_expect(s, 14);
+			cal_SENDACK(t);
+			return 0;
+
+		default :
+			if (command_badsum(s, s->checksum) || s->buffer[0] > SLOT_OP_ACTIVATE) {command_ABORT(s);}
+			if (s->buffer[0] != SLOT_OP_QUERY && command_claimflash(s) == -1) {command_ABORT(s);}
+			command_done(s);
+			cal_SENDACK(t);
+
+			if (s->buffer[0] == SLOT_OP_ACTIVATE) {
+				result = slot_activate(command_getword(s, 1), command_getword(s, 5), command_getword(s, 9));
+			}
+			if (result == -1) {cal_SENDNACK(t);}
+			else {cal_SENDACK(t);}
+			cal_SENDWORD(t, slot_base(slot_active()));
+			cal_SENDWORD(t, slot_inactivebase());
+#ifdef DUALSLOT
+			cal_SENDWORD(t, SLOTSIZE);
+#else
+			cal_SENDWORD(t, FLASHtop + 1 - FLASHbase);
+#endif
+			cal_SENDWORD(t, hil_readbkp(HIL_BKP_BOOTCOUNT));
+			return 0;
+	}
+}
+
+/*
+ * @brief  Reports the manifest of the installed image, in one exchange, so that a
+ *         host can tell whether the device needs an update; records it once installed
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phase 1: operation (MANIFEST_OP_*), three words of arguments, MSB first, unused
+ * ones sent as 0, and checksum of the 13 bytes.
+ * Reply: ACK; ACK if the active slot holds an image matching its header (see
+ * image.h) and the operation succeeded, NACK if not; then the image version,
+ * build ID, length, CRC-32, slot and install time, each MSB first. Version,
+ * length and CRC come from the image header; build ID and install time from the
+ * journal, as recorded for an image of that CRC. Fields not known are sent as
+ * MANIFEST_UNKNOWN.
+ */
+int32_t command_manifest(session_t *s) {
+	uint8_t t = s->transport;
+	uint32_t base;
+	int32_t result = 0;
+	const imageheader_t *h;
+	manifest_t m;
+
+	switch (s->phase) {
+		case 0 :
+			//if (hil_ropactive())  {command_ABORT(s);}
+			command_expect(s, 14);
+			cal_SENDACK(t);
+			return 0;
+
+		default :
+			if (command_badsum(s, s->checksum) || s->buffer[0] > MANIFEST_OP_RECORD) {command_ABORT(s);}
+			if (s->buffer[0] != MANIFEST_OP_QUERY && command_claimflash(s) == -1) {command_ABORT(s);}
+			command_done(s);
+			cal_SENDACK(t);
+
+			base = slot_base(slot_active());
+			h = slot_header(base);
+			if (slot_checkimage(base) != SLOT_IMAGE_VALID) h = 0;
+			if (h == 0) result = -1;
+			else if (s->buffer[0] == MANIFEST_OP_RECORD) {
+				result = journal_install(command_getword(s, 1), command_getword(s, 5), h->crc);
+			}
+			if (journal_manifest(&m) == -1 || h == 0 || m.crc != h->crc) {
+				m.build = MANIFEST_UNKNOWN;
+				m.time = MANIFEST_UNKNOWN;
+			}
+			if (result == -1) {cal_SENDNACK(t);}
+			else {cal_SENDACK(t);}
+			cal_SENDWORD(t, (h != 0) ? h->version : MANIFEST_UNKNOWN);
+			cal_SENDWORD(t, m.build);
+			cal_SENDWORD(t, (h != 0) ? h->length : MANIFEST_UNKNOWN);
+			cal_SENDWORD(t, (h != 0) ? h->crc : MANIFEST_UNKNOWN);
+			cal_SENDWORD(t, slot_active());
+			cal_SENDWORD(t, m.time);
+			return 0;
+	}
+}
+
+/*
+ * @brief  Queries and sets the session timeouts, until the next reset
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phase 1: operation (TIMEOUTS_OP_*), three words of arguments, MSB first, unused
+ * ones sent as 0, and checksum of the 13 bytes.
+ * Reply: ACK; ACK; then the inter-byte, phase and session timeouts in ms now in
+ * force, each MSB first. They apply to every session from the next command on.
+ */
+int32_t command_timeouts(session_t *s) {
+	uint8_t t = s->transport;
+	uint32_t value;
+
+	switch (s->phase) {
+		case 0 :
+			command_expect(s, 14);
+			cal_SENDACK(t);
+			return 0;
+
+		default :
+			if (command_badsum(s, s->checksum) || s->buffer[0] > TIMEOUTS_OP_SET) {command_ABORT(s);}
+			command_done(s);
+			cal_SENDACK(t);
+
+			if (s->buffer[0] == TIMEOUTS_OP_SET) {
+				if ((value = command_getword(s, 1)) != 0) command_timeout.interbyte = value;
+				if ((value = command_getword(s, 5)) != 0) command_timeout.phase = value;
+				if ((value = command_getword(s, 9)) != 0) command_timeout.session = value;
+			}
+			cal_SENDACK(t);
+			cal_SENDWORD(t, command_timeout.interbyte);
+			cal_SENDWORD(t, command_timeout.phase);
+			cal_SENDWORD(t, command_timeout.session);
+			return 0;
+	}
+}
+
+/*
+ * @brief  Reads the RAM log from a position on, without removing anything
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phase 1: operation (LOG_OP_*), three words of arguments, MSB first, unused
+ * ones sent as 0, and checksum of the 13 bytes.
+ * Reply: ACK; ACK; then the position of the first byte sent (later than the one
+ * asked for if the records there are gone), the records not logged for lack of
+ * room and the number N of bytes that follow, each MSB first; then N bytes of
+ * whole records, at most COMMAND_LOGREAD, COMMAND_STEPBYTES per step. The next
+ * read starts N bytes on.
+ */
+int32_t command_log(session_t *s) {
+	uint8_t t = s->transport;
+	uint32_t from, n, i;
+
+	switch (s->phase) {
+		case 0 :
+			command_expect(s, 14);
+			cal_SENDACK(t);
+			return 0;
+
+		case 1 :
+			if (command_badsum(s, s->checksum) || s->buffer[0] > LOG_OP_READ) {command_ABORT(s);}
+
+			/* The program job is over: the spare buffer is free. */
+			from = command_getword(s, 1);
+			n = log_read(&from, s->spare, COMMAND_LOGREAD);
+			s->length = n;
+			s->offset = 0;
+			if (n == 0) command_done(s);
+			else command_continue(s, 2);
+			cal_SENDACK(t);
+			cal_SENDACK(t);
+			cal_SENDWORD(t, from);
+			cal_SENDWORD(t, log_dropped());
+			cal_SENDWORD(t, n);
+			return 0;
+
+		default :
+			/* Records, COMMAND_STEPBYTES per step. */
+			n = s->offset + COMMAND_STEPBYTES;
+			if (n >= s->length) {
+				n = s->length;
+				command_done(s);
+			}
+			for (i = s->offset; i < n; i++) cal_SENDBYTE(t, s->spare[i]);
+			s->offset = n;
+			return 0;
+	}
+}
+
+/*
+ * @brief  Link throughput self-test: moves blocks of a given size to the host, from
+ *         the host or both ways, and reports the bytes moved and the time taken
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phase 1: mode (BENCH_OP_*), payload size (1 to COMMAND_BENCHSIZE), count of
+ * blocks and a word sent as 0, MSB first, and checksum of the 13 bytes.
+ * Then ACK, and the blocks with nothing in between: with BENCH_OP_SOURCE the
+ * device sends them, one per step, bytes counting from 0 in each; with BENCH_OP_SINK the host
+ * sends them; with BENCH_OP_ECHO the host sends each and the device sends it
+ * back as soon as received. Blocks carry no checksum.
+ * Reply: ACK; then the bytes received and sent, the ms and the core cycles
+ * (wrapping past 2^32) from the first ACK to the last block, each MSB first.
+ */
+int32_t command_bench(session_t *s) {
+	uint8_t t = s->transport, *block = 0;
+	benchrun_t *b = &command_benchruns[t-1];
+	uint32_t i;
+
+	switch (s->phase) {
+		case 0 :
+			command_expect(s, 14);
+			cal_SENDACK(t);
+			return 0;
+
+		case 1 :
+			b->mode = s->buffer[0];
+			b->size = command_getword(s, 1);
+			b->left = command_getword(s, 5);
+			if (command_badsum(s, s->checksum) || b->mode < BENCH_OP_SOURCE || b->mode > BENCH_OP_ECHO ||
+				b->size == 0 || b->size > COMMAND_BENCHSIZE) {command_ABORT(s);}
+			b->rx = 0;
+			b->tx = 0;
+			if (b->left == 0) command_done(s);
+			else if (b->mode == BENCH_OP_SOURCE) command_continue(s, 2);
+			else command_expect(s, b->size);
+			cal_SENDACK(t);
+			b->ms = hil_millis();
+			b->cycles = hil_cycles();
+
+			/* The program job is over: the spare buffer is free. */
+			if (b->mode == BENCH_OP_SOURCE) {
+				for (i = 0; i < b->size; i++) s->spare[i] = (uint8_t)i;
+			}
+			if (b->left == 0) return command_benchreport(s, b);
+			return 0;
+
+		default :
+			if (b->mode == BENCH_OP_SOURCE) {
+				/* Next block. */
+				cal_SENDBLOCK(t, s->spare, b->size);
+				b->tx += b->size;
+				if (--b->left != 0) return 0;
+				command_done(s);
+				cal_waitblock(t);
+				return command_benchreport(s, b);
+			}
+
+			b->rx += b->size;
+			b->left--;
+
+			/* The block goes back from its buffer, the next one is collected in the
+			 * other, once the previous echo is out of it. */
+			if (b->mode == BENCH_OP_ECHO) {
+				cal_waitblock(t);
+				block = s->buffer;
+				s->buffer = s->spare;
+				s->spare = block;
+			}
+			if (b->left == 0) command_done(s);
+			else {
+				/* Keep the phase number from wrapping back to 0. */
+				s->phase = 1;
+				command_expect(s, b->size);
+			}
+			if (block != 0) {
+				cal_SENDBLOCK(t, block, b->size);
+				b->tx += b->size;
+			}
+			if (b->left != 0) return 0;
+			cal_waitblock(t);
+			return command_benchreport(s, b);
+	}
+}
+
+/*
+ * @brief  Reports a link self-test, see command_bench()
+ * @param  session, its self-test
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ */
+int32_t command_benchreport(session_t *s, benchrun_t *b) {
+	uint8_t t = s->transport;
+	uint32_t ms = hil_millis() - b->ms, cycles = hil_cycles() - b->cycles;
+
+	cal_SENDACK(t);
+	cal_SENDWORD(t, b->rx);
+	cal_SENDWORD(t, b->tx);
+	cal_SENDWORD(t, ms);
+	cal_SENDWORD(t, cycles);
+	return 0;
+}
+
+#ifdef CBBL_PROFILE
+/*
+ * @brief  Reads and clears the command phase histograms of the instrumentation build
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phase 1: operation (PROFILE_OP_*), three words of arguments, MSB first, unused
+ * ones sent as 0, and checksum of the 13 bytes.
+ * Reply: ACK; ACK if the kind exists, NACK if not; then, for a read, the phases
+ * timed, the cycles of the longest one and the PROFILE_BUCKETS buckets (see
+ * profile.h), each MSB first.
+ */
+int32_t command_profile(session_t *s) {
+	uint8_t t = s->transport, i;
+	profilehist_t hist, *h;
+
+	switch (s->phase) {
+		case 0 :
+			command_expect(s, 14);
+			cal_SENDACK(t);
+			return 0;
+
+		default :
+			if (command_badsum(s, s->checksum) || s->buffer[0] > PROFILE_OP_RESET) {command_ABORT(s);}
+			command_done(s);
+			cal_SENDACK(t);
+
+			if (s->buffer[0] == PROFILE_OP_RESET) {
+				profile_reset();
+				cal_SENDACK(t);
+				return 0;
+			}
+			h = (command_getword(s, 1) < PROFILE_KINDS) ? profile_get(command_getword(s, 1)) : 0;
+			if (h == 0) {cal_SENDNACK(t);}
+
+			/* Copied first: the reply itself is timed. */
+			hist = *h;
+			cal_SENDACK(t);
+			cal_SENDWORD(t, hist.count);
+			cal_SENDWORD(t, hist.max);
+			for (i = 0; i < PROFILE_BUCKETS; i++) cal_SENDWORD(t, hist.buckets[i]);
+			return 0;
+	}
+}
+#endif
+
+/*
+ * @brief  Reads and clears the link counters of a transport
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phase 1: operation (STATS_OP_*), three words of arguments, MSB first, unused
+ * ones sent as 0, and checksum of the 13 bytes.
+ * Reply: ACK; ACK if the transport exists, NACK if not; then the counters of
+ * calstats_t in their order, each MSB first; for a reset, as they were before.
+ */
+int32_t command_stats(session_t *s) {
+	uint8_t t = s->transport, op, i;
+	uint32_t transport;
+	calstats_t stats, *counters;
+
+	switch (s->phase) {
+		case 0 :
+			command_expect(s, 14);
+			cal_SENDACK(t);
+			return 0;
+
+		default :
+			if (command_badsum(s, s->checksum) || s->buffer[0] > STATS_OP_RESET) {command_ABORT(s);}
+			command_done(s);
+			cal_SENDACK(t);
+
+			op = s->buffer[0];
+			transport = command_getword(s, 1);
+			if (transport == 0) transport = t;
+			counters = (transport <= CAL_TRANSPORTS) ? cal_getstats(transport) : 0;
+			if (counters == 0) {cal_SENDNACK(t);}
+
+			/* Copied first: the reply itself is counted. */
+			stats = *counters;
+			if (op == STATS_OP_RESET) cal_resetstats(transport);
+			cal_SENDACK(t);
+			for (i = 0; i < sizeof(calstats_t)/4; i++) {
+				cal_SENDWORD(t, ((uint32_t *)&stats)[i]);
+			}
+			return 0;
+	}
+}
+
+/*
+ * @brief  Checks whether a FLASH page is erased
+ * @param  base address of the page
+ * @retval 1 if all 0xFF
+ * 		   0 if not
+ */
+int32_t command_blankpage(uint32_t page) {
+	uint32_t i;
+	for (i = 0; i < FLASHPAGESIZE/4; i++) {
+		if (hil_readFLASH(page + 4*i) != 0xFFFFFFFF) return 0;
+	}
+	return 1;
+}
+
+/*
+ * @brief  PackBits-style run-length encoding of memory: a control byte c < 128 is
+ *         followed by c+1 literal bytes, a control byte c >= 128 by one byte to be
+ *         repeated c-125 times (3 to 130)
+ * @param  pointer to the address to encode from, advanced past what was encoded;
+ *         end of the range; output; output capacity (at least 129)
+ * @retval number of bytes written, whole tokens only
+ */
+uint32_t command_rle(uint32_t *src, uint32_t end, uint8_t *out, uint32_t cap) {
+	uint8_t *p = (uint8_t*)*src, *e = (uint8_t*)end;
+	uint32_t n = 0, run, lit;
+
+	while (p < e && n + 129 <= cap) {
+		for (run = 1; p + run < e && run < 130 && p[run] == p[0]; run++);
+		if (run >= 3) {
+			out[n++] = (uint8_t)(run + 125);
+			out[n++] = p[0];
+			p += run;
+			continue;
+		}
+		/* Literals up to the next run of three. */
+		for (lit = 1; p + lit < e && lit < 128; lit++) {
+			if (p + lit + 2 < e && p[lit] == p[lit+1] && p[lit] == p[lit+2]) break;
+		}
+		out[n++] = (uint8_t)(lit - 1);
+		for (run = 0; run < lit; run++) out[n++] = p[run];
+		p += lit;
+	}
+	*src = (uint32_t)p;
+	return n;
+}
+
+/*
+ * @brief  Runs a whole update script in one transaction: erase, write, fill,
+ *         verify and jump operations, with a single reply
+ * @param  session
+ * @retval 0 if successful
+ * 		  -1 in unsuccseful
+ *
+ * Phases: 1 16-bit length of the script (at most COMMAND_BATCHSIZE) and checksum,
+ * then for every block 2 number of bytes and 3 data and checksum, as in write
+ * memory; every block but the last is ACKed. Once complete the script is run
+ * from RAM, an operation (a page, for an erase or a fill) per step, stopping at the first
+ * failing operation.
+ * Reply: ACK, number of executed operations - 1, one BATCH_* status byte per
+ * executed operation, ACK.
+ */
+int32_t command_batch(session_t *s) {
+	uint8_t t = s->transport;
+	batchrun_t *b = &command_batchrun;
+	uint32_t i, n;
+
+	switch (s->phase) {
+		case 0 :
+			//if (hil_ropactive())  {command_ABORT(s);}
+			if (command_claimflash(s) == -1) {command_ABORT(s);}
+			command_expect(s, 3);
+			cal_SENDACK(t);
+			return 0;
+
+		case 1 :
+			s->length = ((uint32_t)s->buffer[0] << 8) | s->buffer[1];
+			s->offset = 0;
+			if (command_badsum(s, s->checksum) || s->length == 0 || s->length > COMMAND_BATCHSIZE) {command_ABORT(s);}
+			command_expect(s, 1);
+			cal_SENDACK(t);
+			return 0;
+
+		case 2 :
+			s->number = s->buffer[0];
+			command_expect(s, s->number + 2);
+			return 0;
+
+		case 3 :
+			n = (uint32_t)s->number + 1;
+			if (command_badsum(s, s->checksum ^ s->number) || n > s->length - s->offset) {command_ABORT(s);}
+			for (i = 0; i < n; i++) command_batchbuffer[s->offset + i] = s->buffer[i];
+			s->offset += n;
+			if (s->offset < s->length) {
+				s->phase = 1;
+				command_expect(s, 1);
+				cal_SENDACK(t);
+				return 0;
+			}
+
+			/* Script complete: run it, statuses are collected in the session buffer. */
+			b->cursor = 0;
+			b->ops = 0;
+			b->page = 0;
+			b->end = 0;
+			b->jump = COMMAND_NOPAGE;
+			command_continue(s, 4);
+			return 0;
+
+		default :
+			if (command_batchstep(s) == 0) return 0;
+			command_done(s);
+			cal_SENDACK(t);
+			cal_SENDBYTE(t, b->ops - 1);
+			for (i = 0; i < b->ops; i++) {
+				cal_SENDBYTE(t, s->buffer[i]);
+			}
+			cal_SENDACK(t);
+
+			if (b->jump != COMMAND_NOPAGE) {
+				for (t = 1; t <= CAL_TRANSPORTS; t++) cal_disableinterrupt(t);
+				jumptoapp(b->jump);
+			}
+			return 0;
+	}
+}
+
+/*
+ * @brief  Runs a step of the script held in command_batchbuffer: an operation, or
+ *         a page of the erase or fill operation being run
+ * @param  session (length of the script, status vector in its buffer)
+ * @retval 0 if there are steps left
+ * 		   1 if the script is over, see command_batchrun
+ */
+int32_t command_batchstep(session_t *s) {
+	batchrun_t *b = &command_batchrun;
+	uint8_t *p = command_batchbuffer + b->cursor, *end = command_batchbuffer + s->length;
+	uint8_t op, status = BATCH_OK;
+	uint32_t addr, length, arg;
+	int32_t result;
+
+	/* Erase or fill operation being run, up to the end of the next page. */
+	if (b->page < b->end) {
+		length = ((b->page | (FLASHPAGESIZE-1)) + 1) - b->page;
+		if (length > b->end - b->page) length = b->end - b->page;
+		if (b->op == BATCH_OP_ERASE) result = command_erasepage(b->page);
+		else result = hil_fill(b->page, length, b->pattern);
+		if (result == -1) {
+			s->buffer[b->ops-1] = BATCH_ERR_FLASH;
+			return command_batchend(s);
+		}
+		b->page += length;
+		return 0;
+	}
+	if ((b->ops > 0 && s->buffer[b->ops-1] != BATCH_OK) || p >= end || b->ops == 256) return command_batchend(s);
+
+	op = *p++;
+
+	/* Every operation but a write sees the FLASH with the combined page written. */
+	if (op != BATCH_OP_WRITE && command_flush() == -1) {
+		s->buffer[b->ops++] = BATCH_ERR_FLASH;
+		return command_batchend(s);
+	}
+
+	switch (op) {
+		case BATCH_OP_ERASE :
+			if (end - p < 8) {status = BATCH_ERR_FORMAT; break;}
+			addr = command_be32(p);
+			length = command_be32(p + 4);
+			p += 8;
+			if (length == 0 || addr + length - 1 < addr ||
+				hil_validateaddr(addr) != 1 || hil_validateaddr(addr + length - 1) != 1) {status = BATCH_ERR_ADDR; break;}
+			/* Its pages are erased by the next steps. */
+			b->op = op;
+			b->page = addr & ~(FLASHPAGESIZE-1);
+			b->end = addr + length;
+			break;
+
+		case BATCH_OP_WRITE :
+			if (end - p < 6) {status = BATCH_ERR_FORMAT; break;}
+			addr = command_be32(p);
+			length = ((uint32_t)p[4] << 8) | p[5];
+			p += 6;
+			if (length == 0 || end - p < (int32_t)length) {status = BATCH_ERR_FORMAT; break;}
+			if (hil_validateaddr(addr) != 1 || hil_validateaddr(addr + length - 1) != 1) {status = BATCH_ERR_ADDR; break;}
+			if (command_combine(addr, p, length) == -1) status = BATCH_ERR_FLASH;
+			p += length;
+			break;
+
+		case BATCH_OP_FILL :
+			if (end - p < 12) {status = BATCH_ERR_FORMAT; break;}
+			addr = command_be32(p);
+			length = command_be32(p + 4);
+			arg = command_be32(p + 8);
+			p += 12;
+			if (length == 0 || ((addr | length) & 0x3) != 0 || addr + length - 1 < addr ||
+				hil_validateaddr(addr) != 1 || hil_validateaddr(addr + length - 1) != 1) {status = BATCH_ERR_ADDR; break;}
+			/* Filled by the next steps, a page each. */
+			b->op = op;
+			b->page = addr;
+			b->end = addr + length;
+			b->pattern = arg;
+			break;
+
+		case BATCH_OP_VERIFY :
+			if (end - p < 12) {status = BATCH_ERR_FORMAT; break;}
+			addr = command_be32(p);
+			length = command_be32(p + 4);
+			arg = command_be32(p + 8);
+			p += 12;
+			if (length == 0 || ((addr | length) & 0x3) != 0 || addr + length - 1 < addr || hil_validateaddr(addr) == -1 ||
+				hil_validateaddr(addr + length - 1) != hil_validateaddr(addr)) {status = BATCH_ERR_ADDR; break;}
+			if (hil_crc32(addr, length) != arg) status = BATCH_ERR_CRC;
+			break;
+
+		case BATCH_OP_JUMP :
+			if (end - p < 4) {status = BATCH_ERR_FORMAT; break;}
+			addr = command_be32(p);
+			p += 4;
+			if (p != end) {status = BATCH_ERR_FORMAT; break;}
+			if (hil_validateaddr(addr) == -1) {status = BATCH_ERR_ADDR; break;}
+#ifdef CBBL_AGENT
+			/* The update agent never leaves the application. */
+			status = BATCH_ERR_ADDR;
+			break;
+#endif
+			b->jump = addr;
+			break;
+
+		default :
+			status = BATCH_ERR_FORMAT;
+			break;
+	}
+
+	b->cursor = p - command_batchbuffer;
+	s->buffer[b->ops++] = status;
+	return 0;
+}
+
+/*
+ * @brief  Ends the script run by command_batchstep()
+ * @param  session (length of the script, status vector in its buffer)
+ * @retval 1
+ */
+int32_t command_batchend(session_t *s) {
+	batchrun_t *b = &command_batchrun;
+
+	/* More operations than status bytes: the rest of the script is not run. */
+	if (b->cursor < s->length && s->buffer[b->ops-1] == BATCH_OK) s->buffer[b->ops-1] = BATCH_ERR_FORMAT;
+
+	/* Leave nothing staged behind the reply. */
+	if (command_flush() == -1 && s->buffer[b->ops-1] == BATCH_OK) s->buffer[b->ops-1] = BATCH_ERR_FLASH;
+	if (s->buffer[b->ops-1] != BATCH_OK) b->jump = COMMAND_NOPAGE;
+	return 1;
+}
+
 /**************************** Politecnico di Milano ************END OF FILE****/
@@ -11,35 +11,17 @@
 #include "includes.h"
 #include "cal.h"
 #include "hil.h"
+#include "journal.h"
+#include "slot.h"
+#include "profile.h"
+
+#ifndef COMMANDS_H
+#define COMMANDS_H
 
 typedef  void (*pFunction)(void);
 
 #define BLVERSION (0x10)
 
-/* Exported functions ------------------------------------------------------- */
-int32_t receivecommand(void);
-int32_t command_receiveinit(void);
-
-/* Function prototypes ------------------------------------------------------ */
-uint8_t calculatechecksum(uint8_t *data, uint32_t length);
-int32_t checkchecksumword(uint32_t data, uint8_t length, uint8_t checksum);
-int32_t checkchecksumbytes(uint8_t *data, uint32_t length, uint8_t checksum);
-int32_t jumptoapp(uint32_t addr);
-
-/* Protocol commands handlers ----------------------------------------------- */
-int32_t command_get_command();
-int32_t command_get_version();
-int32_t command_get_id();
-int32_t command_read_memory();
-int32_t command_write_memory(); //*
-int32_t command_go(); //*
-int32_t command_erase(); //*
-int32_t command_extended_erase(); //not implemented
-int32_t command_write_protect();
-int32_t command_write_unprotect(); //*
-int32_t command_readout_protect(); //not implemented
-int32_t command_readout_unprotect(); //not implemented
-
 /* Command header identifier bytes. */
 #define STM32_CMD_INIT 						(0x7F)
 #define STM32_CMD_GET_COMMAND  				(0x00)
@@ -55,8 +37,282 @@ int32_t command_readout_unprotect(); //not implemented
 #define STM32_CMD_READOUT_PROTECT			(0x82)
 #define STM32_CMD_READOUT_UNPROTECT 		(0x92)
 
+/* Vendor command header identifier bytes, outside of AN3155's set. */
+#define CBBL_CMD_WRITE_CHANGED				(0xB1)
+#define CBBL_CMD_PAGE_HASHES				(0xB2)
+#define CBBL_CMD_VERIFY_CRC					(0xB3)
+#define CBBL_CMD_BATCH						(0xB4)
+#define CBBL_CMD_FILL						(0xB5)
+#define CBBL_CMD_DUMP						(0xB6)
+#define CBBL_CMD_JOURNAL					(0xB7)
+#define CBBL_CMD_SLOT						(0xB8)
+#define CBBL_CMD_MANIFEST					(0xB9)
+#define CBBL_CMD_TIMEOUTS					(0xBA)
+#define CBBL_CMD_STATS						(0xBB)
+#define CBBL_CMD_PROFILE					(0xBC)	/* instrumentation build only, see profile.h */
+#define CBBL_CMD_LOG						(0xBD)
+#define CBBL_CMD_BENCH						(0xBE)
+
+/* Batch operations: code byte followed by its arguments, MSB first. */
+#define BATCH_OP_ERASE		(0x01)	/* address, length: erase the pages covering the range */
+#define BATCH_OP_WRITE		(0x02)	/* address, 16-bit length, data: write combined */
+#define BATCH_OP_FILL		(0x03)	/* address, length, pattern: see hil_fill() */
+#define BATCH_OP_VERIFY		(0x04)	/* address, length, CRC-32: see hil_crc32() */
+#define BATCH_OP_JUMP		(0x05)	/* address: reply, then jump, must be the last operation */
+
+/* Batch status vector, one byte per executed operation. */
+#define BATCH_OK			(0x00)
+#define BATCH_ERR_FORMAT	(0x01)	/* unknown operation, truncated arguments or too many operations */
+#define BATCH_ERR_ADDR		(0x02)	/* range not valid */
+#define BATCH_ERR_FLASH		(0x03)	/* erase or program failed */
+#define BATCH_ERR_CRC		(0x04)	/* verify mismatch */
+
+#define COMMAND_BATCHSIZE	(2048)
+
+/* Page number of the erase commands: AN3155 counts the pages from the start of
+ * the FLASH, the bootloader's own pages included (hil_erasecorrespondingpage()
+ * refuses those). */
+#define COMMAND_PAGEADDR(page)	(FLASH_BASE + (uint32_t)(page)*FLASHPAGESIZE)
+
+/* Journal operations, see journal.h. */
+#define JOURNAL_OP_QUERY	(0x00)	/* no arguments */
+#define JOURNAL_OP_OPEN		(0x01)	/* image ID: resume it or start it over */
+#define JOURNAL_OP_COMMIT	(0x02)	/* address, length, CRC-32: record the pages as verified */
+
+/* Slot operations, see slot.h. */
+#define SLOT_OP_QUERY		(0x00)	/* no arguments */
+#define SLOT_OP_ACTIVATE	(0x01)	/* slot, image length, image CRC-32: validate and activate */
+
+/* Manifest operations, see journal_install(). */
+#define MANIFEST_OP_QUERY	(0x00)	/* no arguments */
+#define MANIFEST_OP_RECORD	(0x01)	/* build ID, install time: record them for the installed image */
+#define MANIFEST_UNKNOWN	(0xFFFFFFFF)	/* manifest field not known */
+
+/* Timeouts operations, see timeouts_t. */
+#define TIMEOUTS_OP_QUERY	(0x00)	/* no arguments */
+#define TIMEOUTS_OP_SET		(0x01)	/* inter-byte, phase, session timeouts in ms, 0 to keep one */
+
+/* Link counters operations, see calstats_t. */
+#define STATS_OP_READ		(0x00)	/* transport, 0 for the session's own */
+#define STATS_OP_RESET		(0x01)	/* transport, 0 for the session's own: read, then clear */
+
+/* Profile operations, see profile.h. */
+#define PROFILE_OP_READ		(0x00)	/* kind of phase (PROFILE_*) */
+#define PROFILE_OP_RESET	(0x01)	/* no arguments: clear every histogram */
+
+/* Log operations, see log.h. */
+#define LOG_OP_READ			(0x00)	/* position to read from */
+#define COMMAND_LOGREAD		(256)	/* most log bytes a read replies with */
+
+/* Link self-test modes, see command_bench(). */
+#define BENCH_OP_SOURCE		(0x01)	/* payload size, count: the device sends the blocks */
+#define BENCH_OP_SINK		(0x02)	/* payload size, count: the host sends the blocks */
+#define BENCH_OP_ECHO		(0x03)	/* payload size, count: the device echoes each block */
+#define COMMAND_BENCHSIZE	(STM32_WRITE_BUFSIZE)	/* largest payload */
+
+/* Listen window: ms waiting for the init byte once in the bootloader, before
+ * booting the application; an entry request can ask for another one. */
+#define COMMAND_LISTENWINDOW	(5000)
+
+/* Session timeouts in ms, see timeouts_t; the host may change them. */
+#define COMMAND_INTERBYTE		(100)
+#define COMMAND_PHASETIMEOUT	(5000)
+#define COMMAND_SESSIONTIMEOUT	(60000)
+
+/* us between two bytes read back on CAN, for adapters losing fast bursts. */
+#define COMMAND_CANGAP			(100)
+
+/* Bytes of a long reply sent per handler step, a multiple of 4. */
+#define COMMAND_STEPBYTES		(16)
+
+/* No session to resume, see command_receiveinit(). */
+#define COMMAND_NORESUME		(0xFFFFFFFF)
+
 /* Communication data. */
 #define STM32_COMM_ACK      0x79
 #define STM32_COMM_NACK     0x1F
-#define STM32_COMM_TIMEOUT  2000000
+#define CBBL_COMM_READY     0x52	/* unsolicited, once a session is resumed after a reset */
 #define STM32_WRITE_BUFSIZE 256
+
+/* Session ------------------------------------------------------------------ */
+/*
+ * A session is the parser state of one AN3155 conversation on one transport.
+ * Bytes are pushed in with command_feedbyte() (from a polling loop or from the
+ * transport's ISR), while command_process() runs the handler steps from the
+ * main loop, so flash work never happens in the byte path. There is one session
+ * per transport and they are served concurrently; commands modifying the FLASH
+ * are arbitrated by command_claimflash().
+ * Long replies and erases run in handler steps (see command_continue()): a few
+ * bytes, a page or a frame each, the sessions being served in turn in between.
+ * The FLASH stalls the CPU while a page is erased or programmed, 20 to 40 ms for
+ * an erase: USART bytes of another session arriving meanwhile may be lost,
+ * counted as overruns (see calstats_t), and its host gets the command NACKed on
+ * a timeout and repeats it.
+ */
+#define SESSION_BUFSIZE				(STM32_WRITE_BUFSIZE + 4)
+
+/* Parser states. */
+#define SESSION_STATE_INIT			(0)	/* waiting for the 0x7F init byte */
+#define SESSION_STATE_OPCODE		(1)	/* waiting for a command code */
+#define SESSION_STATE_COMPLEMENT	(2)	/* waiting for the command code complement */
+#define SESSION_STATE_COLLECT		(3)	/* collecting the bytes of a handler phase */
+#define SESSION_STATE_EXECUTE		(4)	/* phase complete, handler step pending */
+
+typedef struct session session_t;
+typedef int32_t (*pHandler)(session_t *s);
+
+struct session {
+	uint8_t transport;				/* cal transport the session is bound to */
+	volatile uint8_t state;			/* SESSION_STATE_* */
+	uint8_t opcode;					/* command code being served */
+	uint8_t phase;					/* handler step, 0 right after the command code is validated */
+	pHandler handler;				/* handler of the command being served */
+	uint32_t expected;				/* bytes to collect in the current phase */
+	volatile uint32_t count;		/* bytes collected so far in the current phase */
+	volatile uint8_t received;		/* set by command_feedbyte(), cleared by command_process() */
+	uint32_t last;					/* hil_millis() at the last byte, as seen by command_process() */
+	uint32_t started;				/* hil_millis() when the current phase was requested or the command done */
+	uint32_t xor32;					/* running XOR of the words collected in the current phase */
+	uint8_t checksum;				/* XOR of the bytes collected in the current phase, once complete */
+	uint8_t number;					/* N byte of the command being served */
+	uint32_t addr;					/* address argument of the command being served */
+	uint32_t length;				/* bytes still to come in a multi-block command */
+	uint32_t offset;				/* bytes staged in the current page of a multi-block command */
+	uint8_t *buffer;				/* pool buffer collecting the current phase */
+	uint8_t *spare;					/* pool buffer handed to the program job, if any */
+#ifdef CBBL_PROFILE
+	uint32_t since;					/* cycles at the first byte of the current phase */
+#endif
+};
+
+/* FLASH program job: a validated write memory block being programmed a word
+ * per command_process() call, while the session already collects the next one. */
+typedef struct {
+	uint32_t addr;					/* next word to program */
+	uint8_t *data;					/* next word of the block, in a pool buffer */
+	volatile uint32_t length;		/* bytes left, 0 if no job pending */
+	uint8_t error;					/* set if programming failed, reported to the next write */
+} flashjob_t;
+
+/* Timeouts of every session, in ms, checked by command_process(). */
+typedef struct {
+	uint32_t interbyte;				/* between two bytes of a command */
+	uint32_t phase;					/* for a whole phase of a command, from its request */
+	uint32_t session;				/* between two commands, before the session is dropped */
+} timeouts_t;
+
+/* Link self-test of a session, see command_bench(). */
+typedef struct {
+	uint8_t mode;					/* BENCH_OP_* */
+	uint32_t size;					/* payload size of a block */
+	uint32_t left;					/* blocks still to move */
+	uint32_t rx;					/* bytes received */
+	uint32_t tx;					/* bytes sent */
+	uint32_t ms;					/* hil_millis() at the start */
+	uint32_t cycles;				/* hil_cycles() at the start */
+} benchrun_t;
+
+/* Dump of a session running, see command_dump(). */
+typedef struct {
+	uint32_t blank[256/32];			/* bit set: page blank */
+	uint32_t ranges;				/* number of non-blank ranges */
+	uint32_t page;					/* next page to map or to look for a range from */
+	uint32_t src;					/* next byte of the range being sent */
+	uint32_t end;					/* end of the range being sent */
+	uint8_t *frame;					/* session buffer the next frame is built in */
+} dumprun_t;
+
+/* Batch being run by the flash owner, see command_batchstep(). */
+typedef struct {
+	uint32_t cursor;				/* next operation, offset in command_batchbuffer */
+	uint32_t ops;					/* operations executed */
+	uint32_t page;					/* next address of the erase or fill operation being run */
+	uint32_t end;					/* end of its range */
+	uint32_t pattern;				/* fill pattern */
+	uint8_t op;						/* BATCH_OP_ERASE or BATCH_OP_FILL */
+	uint32_t jump;					/* address to jump to once replied, COMMAND_NOPAGE if none */
+} batchrun_t;
+
+/* No page held by the write-combining staging page. */
+#define COMMAND_NOPAGE				(0xFFFFFFFF)
+
+/* Section of the static buffer pool: .bufpool (see the linker script), plain
+ * .bss when built into the update agent, linked by the application. */
+#ifdef CBBL_AGENT
+#define COMMAND_BUFPOOL
+#else
+#define COMMAND_BUFPOOL				__attribute__ ((section(".bufpool")))
+#endif
+
+/* Command table entry. */
+typedef struct {
+	uint8_t opcode;
+	pHandler handler;
+} command_t;
+
+/* Exported functions ------------------------------------------------------- */
+int32_t command_receiveinit(uint8_t transport, uint32_t window, uint32_t resume);
+void command_sessioninit(session_t *s, uint8_t transport);
+void command_feedbyte(session_t *s, uint8_t b);
+int32_t command_process(session_t *s);
+int32_t command_poll(session_t *s);
+void command_rxisr(uint8_t transport);
+session_t *command_getsession(uint8_t transport);
+
+/* Function prototypes ------------------------------------------------------ */
+uint8_t calculatechecksum(uint8_t *data, uint32_t length);
+int32_t checkchecksumword(uint32_t data, uint8_t length, uint8_t checksum);
+int32_t checkchecksumbytes(uint8_t *data, uint32_t length, uint8_t checksum);
+int32_t jumptoapp(uint32_t addr);
+void command_expect(session_t *s, uint32_t n);
+void command_done(session_t *s);
+void command_continue(session_t *s, uint8_t phase);
+void command_reset(session_t *s);
+uint32_t command_getword(session_t *s, uint32_t offset);
+int32_t command_badsum(session_t *s, uint8_t residue);
+int32_t command_benchreport(session_t *s, benchrun_t *b);
+uint32_t command_be32(uint8_t *b);
+int32_t command_batchstep(session_t *s);
+int32_t command_batchend(session_t *s);
+int32_t command_erasepage(uint32_t page);
+int32_t command_dumprange(session_t *s, dumprun_t *d);
+uint32_t command_rle(uint32_t *src, uint32_t end, uint8_t *out, uint32_t cap);
+int32_t command_blankpage(uint32_t page);
+int32_t command_claimflash(session_t *s);
+void command_runjob(void);
+int32_t command_combine(uint32_t addr, uint8_t *data, uint32_t n);
+int32_t command_flush(void);
+
+/* Protocol commands handlers ----------------------------------------------- */
+/* Each handler is a step function: it is called once the command code is
+ * validated (phase 0) and then once per completed command_expect() phase. */
+int32_t command_init(session_t *s);
+int32_t command_nack(session_t *s);
+int32_t command_get_command(session_t *s);
+int32_t command_get_version(session_t *s);
+int32_t command_get_id(session_t *s);
+int32_t command_read_memory(session_t *s);
+int32_t command_write_memory(session_t *s); //*
+int32_t command_go(session_t *s); //*
+int32_t command_erase(session_t *s); //*
+int32_t command_extended_erase(session_t *s); //not advertised, mutually exclusive with erase
+int32_t command_write_protect(session_t *s);
+int32_t command_write_unprotect(session_t *s); //*
+int32_t command_readout_protect(session_t *s);
+int32_t command_readout_unprotect(session_t *s);
+int32_t command_write_changed(session_t *s);
+int32_t command_page_hashes(session_t *s);
+int32_t command_verify_crc(session_t *s);
+int32_t command_batch(session_t *s);
+int32_t command_fill(session_t *s);
+int32_t command_dump(session_t *s);
+int32_t command_journal(session_t *s);
+int32_t command_slot(session_t *s);
+int32_t command_manifest(session_t *s);
+int32_t command_timeouts(session_t *s);
+int32_t command_stats(session_t *s);
+int32_t command_profile(session_t *s);
+int32_t command_log(session_t *s);
+int32_t command_bench(session_t *s);
+
+#endif /* COMMANDS_H */
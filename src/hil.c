@@ -9,11 +9,40 @@
   */
 
 #include "hil.h"
+#include "cal.h"
 
 /** @addtogroup CBBL
   * @{
   */
 
+/* FLASH range commands may write and erase: the application area, the staging
+ * slot only when built into the update agent (see agent.h). The bootloader
+ * keeps no RAM state here, as applications call these routines through the
+ * service table (see services.h). */
+#ifdef CBBL_AGENT
+uint32_t hil_flashbase = FLASHbase;
+uint32_t hil_flashtop = FLASHtop;
+#else
+#define hil_flashbase FLASHbase
+#define hil_flashtop FLASHtop
+#endif
+
+/* Boot information left to the application, see bootinfo.h. */
+#ifdef CBBL_AGENT
+bootinfo_t hil_bootinfo;
+#else
+bootinfo_t hil_bootinfo __attribute__ ((section(".bootinfo")));
+#endif
+
+/* Milliseconds since hil_timeinit(), counted by SysTick_Handler(). */
+volatile uint32_t hil_ticks;
+
+#ifdef CBBL_AGENT
+/* SysTick belongs to the application: the milliseconds are taken from the cycle
+ * counter instead, this being the cycle count hil_ticks was last advanced to. */
+uint32_t hil_tickcycles;
+#endif
+
 /*
  * @brief  Get LSB of the device's PID
  * @param  void
@@ -42,8 +71,10 @@ int32_t hil_ropactive(void) {
  * 		  -1 if not valid address
  */
 int32_t hil_validateaddr(uint32_t addr) {
-	if (addr <= FLASHtop && addr >= FLASHbase) return 1;
-	else if (addr <= RAMtop && addr >= RAMbase) return 0;
+	if (addr <= hil_flashtop && addr >= hil_flashbase) return 1;
+#ifndef CBBL_AGENT
+	else if (addr < RAMtop && addr >= RAMbase) return 0;
+#endif
 	else return -1;
 }
 
@@ -66,17 +97,17 @@ return 0;
 }
 
 /*
- * @brief  Mass Erase except bootloader's pages
+ * @brief  Mass Erase except bootloader's pages: the range commands may erase,
+ *         the inactive slot only when built into the update agent
  * @param  void
  * @retval 0 if successful
  * 		  -1 if not successful
  */
 int32_t hil_globalerasememory(void) {
-	int32_t pageaddr = FLASHbase;
-	while (pageaddr<FLASHtop) {
-			 FLASH_ErasePage(pageaddr);
-			 pageaddr = pageaddr + FLASHPAGESIZE;
-		}
+	uint32_t pageaddr;
+	for (pageaddr = hil_flashbase; pageaddr < hil_flashtop; pageaddr += FLASHPAGESIZE) {
+		if (FLASH_ErasePage(pageaddr) != FLASH_COMPLETE) return -1;
+	}
 	return 0;
 }
 
@@ -90,23 +121,162 @@ int32_t hil_globalerasememory(void) {
  * though it is checked not to be a bootloader's page
  */
 int32_t hil_erasecorrespondingpage(int32_t addr) {
-	 if (addr>=FLASHbase && addr<=FLASHtop) {
-		 FLASH_ErasePage(addr);
+	 if (addr>=hil_flashbase && addr<=hil_flashtop) {
+		 if (FLASH_ErasePage(addr) != FLASH_COMPLETE) return -1;
 		 return 0;
 	 }
 	 else return -1;
 }
 
 /*
- * @brief  Erase FLASH bank 1 of the device
- * @param  base address of the page
- * @retval
+ * @brief  Writes a whole FLASH page only where it differs from the given data
+ * @param  base address of the page, FLASHPAGESIZE bytes of word-aligned data
+ * @retval HIL_PAGE_SKIPPED, HIL_PAGE_PROGRAMMED or HIL_PAGE_ERASED if successful
+ * 		  -1 if not successful
+ *
+ * The page is compared word by word first. The STM32F10x FLASH only programs
+ * a half-word still erased (0xFFFF) or clears it to 0x0000, so the page is erased
+ * only if some changed half-word cannot be programmed in place.
  */
-int32_t hil_erasebank1(void) {
-	hil_globalerasememory();
+int32_t hil_writepage(uint32_t pageaddr, uint32_t *data) {
+	uint32_t *flash = (uint32_t*)pageaddr;
+	uint32_t i, diff, cur, want;
+	uint16_t oldhw, newhw;
+	int32_t outcome = HIL_PAGE_SKIPPED;
+
+	if (pageaddr < hil_flashbase || pageaddr > hil_flashtop) return -1;
+
+	for (i = 0; i < FLASHPAGESIZE/4; i++) {
+		diff = flash[i] ^ data[i];
+		if (diff == 0) continue;
+		outcome = HIL_PAGE_PROGRAMMED;
+		cur = flash[i];
+		want = data[i];
+		if (((diff & 0x0000FFFF) && (cur & 0x0000FFFF) != 0x0000FFFF && (want & 0x0000FFFF) != 0) ||
+			((diff & 0xFFFF0000) && (cur & 0xFFFF0000) != 0xFFFF0000 && (want & 0xFFFF0000) != 0)) {
+			outcome = HIL_PAGE_ERASED;
+			break;
+		}
+	}
+	if (outcome == HIL_PAGE_SKIPPED) return outcome;
+
+	if (outcome == HIL_PAGE_ERASED && FLASH_ErasePage(pageaddr) != FLASH_COMPLETE) return -1;
+
+	/* Program the half-words that still differ, nothing else. */
+	for (i = 0; i < FLASHPAGESIZE/2; i++) {
+		oldhw = ((uint16_t*)flash)[i];
+		newhw = ((uint16_t*)data)[i];
+		if (oldhw == newhw) continue;
+		if (FLASH_ProgramHalfWord(pageaddr + 2*i, newhw) != FLASH_COMPLETE) return -1;
+	}
+	return outcome;
+}
+
+/*
+ * @brief  Fills a FLASH range with a 32-bit pattern, without any data on the wire
+ * @param  word-aligned start address, length in bytes (multiple of 4), pattern
+ * @retval 0 if successful
+ * 		  -1 if not successful
+ *
+ * Works page by page as hil_writepage(): half-words already holding the pattern
+ * are not programmed, so filling erased FLASH with 0xFFFFFFFF costs nothing but
+ * the reads. A page that cannot be programmed in place is erased if the range
+ * covers it whole, the fill fails otherwise.
+ */
+int32_t hil_fill(uint32_t addr, uint32_t length, uint32_t pattern) {
+	uint32_t end = addr + length, page, stop, a;
+	uint16_t cur, want;
+	uint8_t erase;
+
+	if (((addr | length) & 0x3) != 0 || length == 0 || end < addr || addr < hil_flashbase || end - 1 > hil_flashtop) return -1;
+
+	while (addr < end) {
+		page = addr & ~(FLASHPAGESIZE-1);
+		stop = (end < page + FLASHPAGESIZE) ? end : page + FLASHPAGESIZE;
+
+		/* Quick pass: anything to do in this page, and can it be done in place? */
+		erase = 0;
+		for (a = addr; a < stop; a += 2) {
+			cur = *(uint16_t*)a;
+			want = (a & 0x2) ? (uint16_t)(pattern >> 16) : (uint16_t)pattern;
+			if (cur != want && cur != 0xFFFF && want != 0x0000) {
+				erase = 1;
+				break;
+			}
+		}
+		if (erase) {
+			if (addr != page || stop != page + FLASHPAGESIZE) return -1;
+			if (FLASH_ErasePage(page) != FLASH_COMPLETE) return -1;
+		}
+
+		for (a = addr; a < stop; a += 2) {
+			want = (a & 0x2) ? (uint16_t)(pattern >> 16) : (uint16_t)pattern;
+			if (*(uint16_t*)a == want) continue;
+			if (FLASH_ProgramHalfWord(a, want) != FLASH_COMPLETE) return -1;
+		}
+		addr = stop;
+	}
 	return 0;
 }
 
+/*
+ * @brief  CRC-32 of a memory range by the CRC peripheral, fed by DMA1 channel 1
+ *         in memory-to-memory mode so that no CPU loop touches the data
+ * @param  word-aligned start address, length in bytes (multiple of 4)
+ * @retval the CRC: polynomial 0x04C11DB7, initial value 0xFFFFFFFF, words fed
+ *         as read in little endian, no reflection, no final XOR
+ */
+uint32_t hil_crc32(uint32_t addr, uint32_t length) {
+	RCC->AHBENR |= RCC_AHBENR_CRCEN;
+	CRC->CR = CRC_CR_RESET;
+	return hil_crc32feed(addr, length);
+}
+
+/*
+ * @brief  Goes on with the CRC-32 of hil_crc32() over another range, so that a CRC
+ *         can skip part of the memory
+ * @param  word-aligned start address, length in bytes (multiple of 4)
+ * @retval the CRC so far
+ */
+uint32_t hil_crc32feed(uint32_t addr, uint32_t length) {
+	uint32_t words = length / 4, chunk;
+
+	RCC->AHBENR |= RCC_AHBENR_CRCEN | RCC_AHBENR_DMA1EN;
+
+	while (words > 0) {
+		/* CNDTR is 16-bit wide. */
+		chunk = (words > 0xFFFF) ? 0xFFFF : words;
+
+		/* Source is the "memory" side, incremented; destination is CRC->DR, fixed. */
+		DMA1_Channel1->CCR = 0;
+		DMA1->IFCR = DMA_IFCR_CGIF1;
+		DMA1_Channel1->CPAR = (uint32_t)&CRC->DR;
+		DMA1_Channel1->CMAR = addr;
+		DMA1_Channel1->CNDTR = chunk;
+		DMA1_Channel1->CCR = DMA_CCR1_MEM2MEM | DMA_CCR1_MSIZE_1 | DMA_CCR1_PSIZE_1 |
+							 DMA_CCR1_MINC | DMA_CCR1_DIR | DMA_CCR1_EN;
+
+		/* Wait until transfer complete (or error). */
+		while (!(DMA1->ISR & (DMA_ISR_TCIF1 | DMA_ISR_TEIF1)));
+		DMA1_Channel1->CCR = 0;
+		DMA1->IFCR = DMA_IFCR_CGIF1;
+
+		addr += chunk * 4;
+		words -= chunk;
+	}
+	return CRC->DR;
+}
+
+/*
+ * @brief  Erase FLASH bank 1 of the device, as hil_globalerasememory()
+ * @param  void
+ * @retval 0 if successful
+ * 		  -1 if not successful
+ */
+int32_t hil_erasebank1(void) {
+	return hil_globalerasememory();
+}
+
 // Only one bank present in STM32F10x MD
 int32_t hil_erasebank2(void) {
 	return 0;
@@ -119,8 +289,8 @@ int32_t hil_erasebank2(void) {
  */
 void hil_reset(void) {
 
-	/* Wait for some time; need of this delay discovered while debugging. */
-	delay(0xFFF);
+	/* Let the last reply leave the transport; need of this delay discovered while debugging. */
+	hil_delayus(HIL_RESETDELAY);
 
 	/* Ensure completion of memory access. */
 	__DSB();
@@ -143,6 +313,172 @@ void hil_reset(void) {
 	while(1);
 }
 
+#ifdef CBBL_AGENT
+/*
+ * @brief  Restricts the FLASH range commands may write and erase
+ * @param  first and last address, within the application area
+ * @retval void
+ */
+void hil_setflashrange(uint32_t base, uint32_t top) {
+	hil_flashbase = base;
+	hil_flashtop = top;
+}
+#endif
+
+/*
+ * @brief  Gets the FLASH range commands may write and erase, the one
+ *         hil_erasebank1() erases
+ * @param  first and last address
+ * @retval void
+ */
+void hil_getflashrange(uint32_t *base, uint32_t *top) {
+	*base = hil_flashbase;
+	*top = hil_flashtop;
+}
+
+/*
+ * @brief  Enables the backup registers and unlocks their writing
+ * @param  void
+ * @retval void
+ */
+void hil_bkpinit(void) {
+	RCC->APB1ENR |= RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN;
+	PWR->CR |= PWR_CR_DBP;
+}
+
+/*
+ * @brief  Requests the bootloader to serve a host, leaving the request in the
+ *         backup registers, and resets; meant for applications (see services.h)
+ * @param  transport (CAL_USART, CAL_CAN, 0 for every transport), baud rate
+ *         (0 for the default), listen window in ms (0 for the default); both
+ *         are clamped to what the 16-bit registers hold, see hil.h
+ * @retval none, the device resets
+ */
+void hil_requestentry(uint8_t transport, uint32_t baud, uint32_t window) {
+	hil_bkpinit();
+	hil_writebkp(HIL_BKP_MAILBOXBAUD, (baud / 100 > 0xFFFF) ? 0xFFFF : baud / 100);
+	hil_writebkp(HIL_BKP_MAILBOXWINDOW, (window > 0xFFFF) ? 0xFFFF : window);
+	hil_writebkp(HIL_BKP_MAILBOX, HIL_MAILBOX | transport);
+	hil_reset();
+}
+
+/*
+ * @brief  Resets keeping the session in the backup registers, so that the bootloader
+ *         comes back already connected to the host (see command_receiveinit())
+ * @param  transport, its baud rate, code of the command resetting
+ * @retval none, the device resets
+ */
+void hil_resetsession(uint8_t transport, uint32_t baud, uint8_t opcode) {
+	hil_writebkp(HIL_BKP_MAILBOXBAUD, baud / 100);
+	hil_writebkp(HIL_BKP_MAILBOXWINDOW, opcode);
+	hil_writebkp(HIL_BKP_MAILBOX, HIL_MAILBOX_RESUME | transport);
+	hil_reset();
+}
+
+/*
+ * @brief  Resets asking the bootloader to boot straight away, as after a power-on,
+ *         without waiting for a host; meant for the update agent (see agent.h)
+ * @param  void
+ * @retval none, the device resets
+ */
+void hil_requestboot(void) {
+	hil_bkpinit();
+	hil_writebkp(HIL_BKP_MAILBOX, HIL_MAILBOX_BOOT);
+	hil_reset();
+}
+
+/*
+ * @brief  Takes the entry request left by hil_requestentry(), the session left by
+ *         hil_resetsession() or the boot request left by hil_requestboot(), if any,
+ *         clearing it
+ * @param  transport, baud rate and listen window requested, left unchanged
+ *         where the request keeps the defaults; code of the command that reset
+ * @retval HIL_ENTRY_REQUESTED, HIL_ENTRY_RESUMED, HIL_ENTRY_BOOT or HIL_ENTRY_NONE
+ */
+int32_t hil_takemailbox(uint8_t *transport, uint32_t *baud, uint32_t *window, uint8_t *opcode) {
+	uint16_t mailbox = hil_readbkp(HIL_BKP_MAILBOX);
+
+	if (mailbox == HIL_MAILBOX_BOOT) {
+		hil_writebkp(HIL_BKP_MAILBOX, 0);
+		return HIL_ENTRY_BOOT;
+	}
+	if ((mailbox & HIL_MAILBOX_MASK) != HIL_MAILBOX && (mailbox & HIL_MAILBOX_MASK) != HIL_MAILBOX_RESUME) {
+		return HIL_ENTRY_NONE;
+	}
+	hil_writebkp(HIL_BKP_MAILBOX, 0);
+	/* A transport that does not exist is served as every transport. */
+	*transport = ((mailbox & 0xFF) <= CAL_TRANSPORTS) ? (mailbox & 0xFF) : 0;
+	if (hil_readbkp(HIL_BKP_MAILBOXBAUD) != 0) *baud = 100 * (uint32_t)hil_readbkp(HIL_BKP_MAILBOXBAUD);
+	if ((mailbox & HIL_MAILBOX_MASK) == HIL_MAILBOX_RESUME) {
+		*opcode = hil_readbkp(HIL_BKP_MAILBOXWINDOW);
+		return HIL_ENTRY_RESUMED;
+	}
+	if (hil_readbkp(HIL_BKP_MAILBOXWINDOW) != 0) *window = hil_readbkp(HIL_BKP_MAILBOXWINDOW);
+	return HIL_ENTRY_REQUESTED;
+}
+
+/*
+ * @brief  Starts the millisecond timebase: SysTick interrupt every ms
+ * @param  void
+ * @retval void
+ */
+void hil_timeinit(void) {
+	hil_ticks = 0;
+#ifdef CBBL_AGENT
+	hil_cyclesinit();
+	hil_tickcycles = 0;
+#else
+	SysTick_Config(SystemCoreClock / 1000);
+#endif
+}
+
+/*
+ * @brief  SysTick interrupt body
+ * @param  void
+ * @retval void
+ */
+void hil_tick(void) {
+	hil_ticks++;
+}
+
+/*
+ * @brief  Milliseconds elapsed since hil_timeinit(); compare differences, it wraps.
+ *         Built into the update agent, it must be called from one context only
+ *         and at least once every 2^32 cycles.
+ * @param  void
+ * @retval milliseconds
+ */
+uint32_t hil_millis(void) {
+#ifdef CBBL_AGENT
+	uint32_t ms = (hil_cycles() - hil_tickcycles) / (SystemCoreClock / 1000);
+
+	hil_ticks += ms;
+	hil_tickcycles += ms * (SystemCoreClock / 1000);
+#endif
+	return hil_ticks;
+}
+
+/*
+ * @brief  Reads a backup data register
+ * @param  register number, 1 to 10, up to 42 on high-density parts (HIL_BKP_*)
+ * @retval the register
+ */
+uint16_t hil_readbkp(uint8_t n) {
+	/* DR11 on do not follow DR10. */
+	if (n > 10) return *(&BKP->DR11 + 2*(n-11));
+	return *(&BKP->DR1 + 2*(n-1));
+}
+
+/*
+ * @brief  Writes a backup data register, once unlocked by hil_bkpinit()
+ * @param  register number, 1 to 10, up to 42 on high-density parts (HIL_BKP_*), value
+ * @retval void
+ */
+void hil_writebkp(uint8_t n, uint16_t value) {
+	if (n > 10) *(&BKP->DR11 + 2*(n-11)) = value;
+	else *(&BKP->DR1 + 2*(n-1)) = value;
+}
+
 int32_t hil_removewriteprotectionflashmem(void) {
 	FLASH->CR = FLASH_CR_OPTER;
 	return  0;
@@ -167,47 +503,129 @@ int32_t hil_clearram(void) {
 	return 0;
 }
 
-void hil_clock_init(void) {
-	/* Activate HSE, HSI. */
-	RCC->CR |= RCC_CR_HSEON | RCC_CR_HSION;
-
-	/* Wait until HSE is stable. */
-	while (!(RCC->CR & RCC_CR_HSERDY));
-
-	/* Wait until HSI is stable. */
-	while (!(RCC->CR & RCC_CR_HSIRDY));
-
-	/* PLL setup. */
-	RCC->CFGR |= RCC_CFGR_PLLMULL9 | RCC_CFGR_PLLXTPRE_HSE | RCC_CFGR_PLLSRC_HSE;
+/*
+ * @brief  Initializes what the boot decision and the fast boot path need: backup
+ *         registers, FLASH controller (slot metadata) and the PB1 button. The clocks
+ *         are set up once, by SystemInit() (72MHz from HSE).
+ * @param  void
+ * @retval void
+ */
+void hil_bootinit(void) {
+	/* Reset flags, before hil_isSWreset() clears them. */
+	hil_bootinfo.magic = 0;
+	hil_bootinfo.resetcause = RCC->CSR >> 24;
+	hil_bootinfo.slot = BOOTINFO_NOSLOT;
+	hil_bootinfo.reserved = 0;
+	hil_bootinfo.length = 0;
+	hil_bootinfo.crc = 0;
+
+	hil_bkpinit();
+	hil_FPECenable();
 
-	/* Activate PLL. */
-	RCC->CR   |= RCC_CR_PLLON;
+	/* PB1 input with pull-up, as GPIOinit() sets it. */
+	RCC->APB2ENR |= RCC_APB2ENR_IOPBEN;
+	GPIOB->CRL = (GPIOB->CRL & ~(0xF << (1 * 4))) | (0x08 << (1 * 4));
+	GPIOB->ODR |= GPIO_ODR_ODR1;
+}
 
-	/* Wait until PLL is stable. */
-	while (!(RCC->CR & RCC_CR_PLLRDY));
+/*
+ * @brief  Initializes HW platform for serving a host, after hil_bootinit()
+ * @param  void
+ * @retval void
+ */
+void hil_init(void) {
+	hil_timeinit();
+	//CLEAR OPTION BYTES
+}
 
-	/* AHB, APB1 and APB2 prescaler setup. */
-	RCC->CFGR |= RCC_CFGR_HPRE_DIV1 | RCC_CFGR_PPRE1_DIV1 | RCC_CFGR_PPRE2_DIV1;
+/*
+ * @brief  Starts the DWT cycle counter; called first thing by Reset_Handler(),
+ *         before the data and bss are initialized
+ * @param  void
+ * @retval void
+ */
+void hil_cyclesinit(void) {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	HIL_DWT_CYCCNT = 0;
+	HIL_DWT_CTRL |= HIL_DWT_CTRL_CYCCNTENA;
+}
 
-	/* FLASH wait states setup. */
-	FLASH->ACR |= FLASH_ACR_LATENCY_2;
+/*
+ * @brief  Cycles since reset, see hil_cyclesinit(); compare differences, it wraps
+ * @param  void
+ * @retval cycles
+ */
+uint32_t hil_cycles(void) {
+	return HIL_DWT_CYCCNT;
+}
 
-	/* Set PLL as system clock. */
-	RCC->CFGR |= RCC_CFGR_SW_PLL;
+/*
+ * @brief  Records the cycles from reset to the jump to the application in the
+ *         boot information
+ * @param  void
+ * @retval void
+ */
+void hil_recordboot(void) {
+	hil_bootinfo.bootcycles = hil_cycles();
+}
 
-	/* Wait until PLL is the system clock. */
-	while (!(RCC->CFGR & RCC_CFGR_SWS_PLL ));
+/*
+ * @brief  Records the image about to be booted as validated against its CRC-32
+ * @param  slot, image length, image CRC-32
+ * @retval void
+ */
+void hil_bootvalidated(uint8_t slot, uint32_t length, uint32_t crc) {
+	hil_bootinfo.slot = slot;
+	hil_bootinfo.length = length;
+	hil_bootinfo.crc = crc;
 }
 
 /*
- * @brief  Initializes HW platform and its Flash memory controller
- * @param  void
+ * @brief  Leaves the device as the application expects it out of reset, but for
+ *         the clocks of the FLASH and the boot information: interrupts disabled
+ *         and cleared, peripherals used by the bootloader reset, clock tree back
+ *         to HSI, FLASH controller locked, vector table at the application's
+ * @param  application address, bootloader version
  * @retval void
  */
-void hil_init(void) {
-	hil_clock_init();
-	hil_FPECenable();
-	//CLEAR OPTION BYTES
+void hil_handoff(uint32_t addr, uint8_t version) {
+	uint32_t i;
+
+	__disable_irq();
+	SysTick->CTRL = 0;
+	SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+	for (i = 0; i < 8; i++) {
+		NVIC->ICER[i] = 0xFFFFFFFF;
+		NVIC->ICPR[i] = 0xFFFFFFFF;
+	}
+
+	/* USART1, USART2, CAN1, GPIO and DMA back to their reset state. */
+	DMA1_Channel1->CCR = 0;
+	DMA1_Channel4->CCR = 0;
+	DMA1_Channel7->CCR = 0;
+	RCC->APB2RSTR = RCC_APB2RSTR_USART1RST | RCC_APB2RSTR_IOPARST | RCC_APB2RSTR_IOPBRST |
+					RCC_APB2RSTR_IOPDRST | RCC_APB2RSTR_AFIORST;
+	RCC->APB2RSTR = 0;
+	RCC->APB1RSTR = RCC_APB1RSTR_CAN1RST | RCC_APB1RSTR_USART2RST;
+	RCC->APB1RSTR = 0;
+
+	FLASH->CR |= FLASH_CR_LOCK;
+	PWR->CR &= ~PWR_CR_DBP;
+
+	/* Clock tree and peripheral clocks as out of reset. */
+	RCC_DeInit();
+	RCC->AHBENR = RCC_AHBENR_SRAMEN | RCC_AHBENR_FLITFEN;
+	RCC->APB2ENR = 0;
+	RCC->APB1ENR = 0;
+
+	SCB->VTOR = addr;
+
+	hil_bootinfo.version = version;
+	hil_bootinfo.appbase = addr;
+	hil_bootinfo.magic = BOOTINFO_MAGIC;
+
+	/* PRIMASK as out of reset, no interrupt source being left enabled. */
+	__enable_irq();
 }
 
 /*
@@ -216,7 +634,7 @@ void hil_init(void) {
  * @retval void
  */
 void hil_FPECenable(void) {
-	FLASH_Unlock();
+	if (FLASH->CR & FLASH_CR_LOCK) FLASH_Unlock();
 }
 
 /*
@@ -235,13 +653,18 @@ int8_t hil_isSWreset(void) {
 }
 
 /*
- * @brief  Helper function for delay. Loops as many times as the delay parameter
- * @param  uint32_t delay
+ * @brief  Busy-waits on the cycle counter, enabling it if the application did not
+ *         leave it running; assumes HIL_CYCLESPERUS, longer at a slower clock
+ * @param  microseconds
  * @retval none
  */
-void delay(uint32_t delay) {
-	uint32_t i = 0;
-	while(i<delay) i++;
+void hil_delayus(uint32_t us) {
+	uint32_t start;
+
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	HIL_DWT_CTRL |= HIL_DWT_CTRL_CYCCNTENA;
+	start = hil_cycles();
+	while (hil_cycles() - start < us * HIL_CYCLESPERUS);
 }
 
 /**
@@ -8,20 +8,89 @@
   ******************************************************************************
   */
 #include "includes.h"
+#include "bootinfo.h"
 
 #define STM32F10X_MD
 #define BOARD 07301A-15
 #define PCLK1 (0x112A880) //value given in Hz: 18MHz
 
+/* Two application slots A/B on HD/XL parts (512K FLASH, 2K pages), the new image
+ * being written to the inactive one; comment out on MD parts. See slot.h. */
+//#define DUALSLOT
+
+#ifdef DUALSLOT
+#define PIDBYTE2				(0x14)
+#define FLASHbase				(0x08003000)
+#define FLASHtop				(0x0807DFFF)	/* application area: slot A and slot B */
+#define SLOTAbase				(0x08003000)
+#define SLOTBbase				(0x08040800)
+#define SLOTSIZE				(0x3D800)
+#define SLOTMETAbase			(0x0807E000)
+#define SLOTMETAPAGES			(2)
+#define JOURNALbase				(0x0807F000)
+#define JOURNALPAGES			(2)
+#define FLASHPAGESIZE   		(0x800)
+#define SECTORSIZE      		(0x1000)
+#define RAMbase         		(0x20002400)	/* past the whole RAM of the bootloader, its stack included */
+#define RAMtop          		(0x20010000)	/* end of the RAM, excluded */
+#else
 #define PIDBYTE2				(0x10)
 #define FLASHbase				(0x08003000)
-#define FLASHtop				(0x0801FFFF)
+#define FLASHtop				(0x0801F7FF)	/* application area, the journal pages follow */
+#define JOURNALbase				(0x0801F800)
+#define JOURNALPAGES			(2)
 #define FLASHPAGESIZE   		(0x400)
 #define SECTORSIZE      		(0x1000)
-#define RAMbase         		(0x20000200)
-#define RAMtop          		(0x20005000)
+#define RAMbase         		(0x20002400)	/* past the whole RAM of the bootloader, its stack included */
+#define RAMtop          		(0x20005000)	/* end of the RAM, excluded */
+#endif
 #define SCBAIRCR_SYSRESETVALUE  (0xF5FA0004)
 
+/* Backup data registers (BKP->DR1..DR10, and DR11..DR42 on high-density parts, 16-bit), kept across resets. */
+#define HIL_BKP_BOOTCOUNT		(1)		/* boots of the active slot not confirmed by the application */
+#define HIL_BKP_REQUEST			(2)		/* SLOT_REQUEST | slot: activation requested by the update agent */
+#define HIL_BKP_LENGTHHI		(3)		/* length of the image to activate */
+#define HIL_BKP_LENGTHLO		(4)
+#define HIL_BKP_CRCHI			(5)		/* CRC-32 of the image to activate */
+#define HIL_BKP_CRCLO			(6)
+#define HIL_BKP_MAILBOX			(7)		/* HIL_MAILBOX or HIL_MAILBOX_RESUME | transport, or HIL_MAILBOX_BOOT */
+#define HIL_BKP_MAILBOXBAUD		(8)		/* baud rate / 100 to listen at, 0 for the default;
+										 * at most 6553500 baud, larger rates are clamped */
+#define HIL_BKP_MAILBOXWINDOW	(9)		/* entry: listen window in ms, 0 for the default,
+										 * at most 65535 ms, longer windows are clamped;
+										 * resume: code of the command that reset */
+#define HIL_BKP_IMAGECACHE		(10)	/* key of the image header found valid, 0 if none */
+#define HIL_BKP_SLOTCACHE		(11)	/* key of the slot record found valid, 0 if none;
+										 * high-density parts only, as DUALSLOT */
+
+/* Bootloader entry mailbox, see hil_requestentry(), hil_resetsession() and hil_requestboot(). */
+#define HIL_MAILBOX				(0xB100)	/* entry requested by the application */
+#define HIL_MAILBOX_RESUME		(0xB200)	/* session to resume after a reset of the bootloader */
+#define HIL_MAILBOX_BOOT		(0xB300)	/* boot straight away, by the update agent */
+#define HIL_MAILBOX_MASK		(0xFF00)
+
+/* Outcome of hil_takemailbox(). */
+#define HIL_ENTRY_NONE			(0)
+#define HIL_ENTRY_REQUESTED		(1)
+#define HIL_ENTRY_RESUMED		(2)
+#define HIL_ENTRY_BOOT			(3)
+
+/* DWT cycle counter, not in this CMSIS version. */
+#define HIL_DWT_CTRL			(*(volatile uint32_t *)0xE0001000)
+#define HIL_DWT_CYCCNT			(*(volatile uint32_t *)0xE0001004)
+#define HIL_DWT_CTRL_CYCCNTENA	(0x00000001)
+
+/* Cycles per us at the clock set by SystemInit(), for hil_delayus(). */
+#define HIL_CYCLESPERUS			(72)
+
+/* us waited by hil_reset() before resetting: a byte at 9600 baud and then some. */
+#define HIL_RESETDELAY			(2000)
+
+/* Outcome of hil_writepage(). */
+#define HIL_PAGE_SKIPPED		(0)		/* page already held the data */
+#define HIL_PAGE_PROGRAMMED		(1)		/* changed half-words programmed, no erase */
+#define HIL_PAGE_ERASED			(2)		/* page erased and programmed */
+
 /* Exported functions ------------------------------------------------------- */
 void hil_init(void);
 
@@ -33,9 +102,25 @@ int32_t hil_writeflash(uint32_t startaddr);
 int32_t hil_writeram(uint32_t startaddr);
 int32_t hil_globalerasememory(void);
 int32_t hil_erasecorrespondingpage(int32_t addr);
+int32_t hil_writepage(uint32_t pageaddr, uint32_t *data);
+uint32_t hil_crc32(uint32_t addr, uint32_t length);
+uint32_t hil_crc32feed(uint32_t addr, uint32_t length);
+int32_t hil_fill(uint32_t addr, uint32_t length, uint32_t pattern);
 int32_t hil_erasebank1(void);
 int32_t hil_erasebank2(void);
 void hil_reset(void);
+void hil_setflashrange(uint32_t base, uint32_t top);
+void hil_getflashrange(uint32_t *base, uint32_t *top);
+void hil_bkpinit(void);
+void hil_requestentry(uint8_t transport, uint32_t baud, uint32_t window);
+void hil_requestboot(void);
+void hil_resetsession(uint8_t transport, uint32_t baud, uint8_t opcode);
+int32_t hil_takemailbox(uint8_t *transport, uint32_t *baud, uint32_t *window, uint8_t *opcode);
+void hil_timeinit(void);
+void hil_tick(void);
+uint32_t hil_millis(void);
+uint16_t hil_readbkp(uint8_t n);
+void hil_writebkp(uint8_t n, uint16_t value);
 int32_t hil_removewriteprotectionflashmem(void);
 int32_t hil_enablewriteprotectionflashmen(uint32_t sector);
 int32_t hil_disablerop(void);
@@ -43,7 +128,12 @@ int32_t hil_enablerop(void);
 int32_t hil_clearram(void);//clear whole ram , should be different from globalerasememory()
 
 
-void hil_clock_init(void);
+void hil_bootinit(void);
+void hil_cyclesinit(void);
+uint32_t hil_cycles(void);
+void hil_recordboot(void);
+void hil_bootvalidated(uint8_t slot, uint32_t length, uint32_t crc);
+void hil_handoff(uint32_t addr, uint8_t version);
 void hil_FPECenable(void);
 int8_t hil_isSWreset();
-void delay(uint32_t delay);
+void hil_delayus(uint32_t us);
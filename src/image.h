@@ -0,0 +1,41 @@
+/**
+  ******************************************************************************
+  * @file    CBBL_usart/src/image.h
+  * @author  Marco Zavatta, Yin Zhining
+  * @version V1.0
+  * @date    03/04/2012
+  * @brief   Application image header
+  ******************************************************************************
+  */
+
+#include <stdint.h>
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+/*
+ * An application image may carry a header at IMAGE_HEADEROFFSET from its start,
+ * right after its vector table, in the manner of the bootloader's own service
+ * table. The application links it with magic and version filled in, e.g.
+ *
+ *   const imageheader_t header __attribute__ ((section(".imageheader"))) =
+ *   	{IMAGE_MAGIC, 0, 0, 0x0102};
+ *
+ * and its build patches length and CRC into the binary. The CRC is the one of
+ * hil_crc32() over the first length bytes of the image, the header left out.
+ * The bootloader checks it before booting: an image without a header is booted
+ * as it is, one whose CRC does not match is not booted. This header is all an
+ * application needs.
+ */
+
+#define IMAGE_HEADEROFFSET		(0x200)
+#define IMAGE_MAGIC				(0x43424948)	/* "CBIH" */
+
+typedef struct {
+	uint32_t magic;					/* IMAGE_MAGIC */
+	uint32_t length;				/* image length in bytes from its start, multiple of 4 */
+	uint32_t crc;					/* CRC-32 of the image but this header */
+	uint32_t version;				/* application version */
+} imageheader_t;
+
+#endif /* IMAGE_H */
@@ -0,0 +1,251 @@
+/**
+  ******************************************************************************
+  * @file    CBBL_usart/src/journal.c
+  * @author  Marco Zavatta, Yin Zhining
+  * @version V1.0
+  * @date    03/04/2012
+  * @brief   Update progress journal
+  ******************************************************************************
+  */
+
+#include "journal.h"
+#include "slot.h"
+
+/** @addtogroup CBBL
+  * @{
+  */
+
+/* Journal state, rebuilt from the FLASH by journal_load(). */
+uint32_t journal_currentimage = JOURNAL_NOIMAGE;
+uint32_t journal_pages[(JOURNAL_MAXPAGES + 31)/32];	/* bit set: page verified */
+uint32_t journal_next = JOURNALbase;					/* first free record */
+manifest_t journal_installed;							/* manifest of the installed image */
+uint8_t journal_hasmanifest = 0;						/* set if journal_installed was recorded */
+
+/*
+ * @brief  Rebuilds the journal state by scanning its records. A page record only
+ *         counts if the page still has the recorded CRC, so pages written after
+ *         being verified are found incomplete again.
+ * @param  void
+ * @retval void
+ *
+ * A record whose tag is still erased while its value is not was torn by a reset
+ * and is skipped, as are unknown tags; the log ends at the first erased record.
+ */
+void journal_load(void) {
+	uint32_t rec, tag, value, page, i;
+	manifest_t m = {JOURNAL_NOIMAGE, JOURNAL_NOIMAGE, JOURNAL_NOIMAGE};
+
+	journal_currentimage = JOURNAL_NOIMAGE;
+	journal_hasmanifest = 0;
+	for (i = 0; i < (JOURNAL_MAXPAGES + 31)/32; i++) journal_pages[i] = 0;
+
+	for (rec = JOURNALbase; rec < JOURNALtop; rec += JOURNAL_RECORDSIZE) {
+		tag = hil_readFLASH(rec);
+		value = hil_readFLASH(rec + 4);
+		if (tag == JOURNAL_FREE && value == JOURNAL_FREE) break;
+
+		if (tag == JOURNAL_TAG_IMAGE) {
+			journal_currentimage = value;
+			for (i = 0; i < (JOURNAL_MAXPAGES + 31)/32; i++) journal_pages[i] = 0;
+		}
+		else if ((tag & JOURNAL_TAG_MASK) == JOURNAL_TAG_PAGE && journal_currentimage != JOURNAL_NOIMAGE) {
+			page = tag & ~JOURNAL_TAG_MASK;
+			if (page < JOURNAL_MAXPAGES && hil_crc32(FLASHbase + page*FLASHPAGESIZE, FLASHPAGESIZE) == value) {
+				journal_pages[page/32] |= 1 << (page%32);
+			}
+		}
+		else if (tag == JOURNAL_TAG_BUILD) m.build = value;
+		else if (tag == JOURNAL_TAG_TIME) m.time = value;
+		else if (tag == JOURNAL_TAG_INSTALLED) {
+			m.crc = value;
+			journal_installed = m;
+			journal_hasmanifest = 1;
+		}
+	}
+	journal_next = rec;
+}
+
+/*
+ * @brief  Opens the update of an image: the progress is kept if the journal already
+ *         follows the same image ID, otherwise the journal restarts from scratch
+ * @param  image ID
+ * @retval 0 if successful
+ * 		  -1 if not successful
+ */
+int32_t journal_open(uint32_t image) {
+	journal_load();
+	if (image == journal_currentimage) return 0;
+	if (image == JOURNAL_NOIMAGE || journal_erase() == -1) return -1;
+	if (journal_append(JOURNAL_TAG_IMAGE, image) == -1) return -1;
+
+	/* The installed image is still there until the update ends. */
+	return journal_keepmanifest();
+}
+
+/*
+ * @brief  Records the pages of a range as verified, provided the range matches the CRC
+ * @param  page-aligned address, length in bytes (multiple of FLASHPAGESIZE),
+ *         CRC-32 of the range as computed by hil_crc32()
+ * @retval 0 if successful
+ * 		  -1 if no image is open, the range is not valid, the CRC does not match
+ * 		     or the journal could not be written
+ */
+int32_t journal_commit(uint32_t addr, uint32_t length, uint32_t crc) {
+	uint32_t page;
+
+	journal_load();
+	if (journal_currentimage == JOURNAL_NOIMAGE || length == 0 ||
+		((addr | length) & (FLASHPAGESIZE-1)) != 0 ||
+		addr < FLASHbase || addr > FLASHtop || length > FLASHtop - addr + 1) return -1;
+	if (hil_crc32(addr, length) != crc) return -1;
+
+	for (page = (addr - FLASHbase)/FLASHPAGESIZE; page < (addr + length - FLASHbase)/FLASHPAGESIZE; page++) {
+		if (journal_pages[page/32] & (1 << (page%32))) continue;
+		if (journal_append(JOURNAL_TAG_PAGE | page, hil_crc32(FLASHbase + page*FLASHPAGESIZE, FLASHPAGESIZE)) == -1) return -1;
+		journal_pages[page/32] |= 1 << (page%32);
+	}
+	return 0;
+}
+
+/*
+ * @brief  Image ID followed by the journal
+ * @param  void
+ * @retval image ID, JOURNAL_NOIMAGE if none
+ */
+uint32_t journal_image(void) {
+	return journal_currentimage;
+}
+
+/*
+ * @brief  First page of the slot being updated (the inactive one, see slot.h) not
+ *         verified yet, where an update resumes
+ * @param  void
+ * @retval page address, the end of the slot if all its pages are verified
+ */
+uint32_t journal_firstincomplete(void) {
+	uint32_t page, first = (slot_inactivebase() - FLASHbase)/FLASHPAGESIZE;
+	for (page = first; page < first + SLOT_IMAGESIZE/FLASHPAGESIZE; page++) {
+		if (!(journal_pages[page/32] & (1 << (page%32)))) break;
+	}
+	return FLASHbase + page*FLASHPAGESIZE;
+}
+
+/*
+ * @brief  Number of pages verified
+ * @param  void
+ * @retval number of pages
+ */
+uint32_t journal_verified(void) {
+	uint32_t page, n = 0;
+	for (page = 0; page < JOURNAL_MAXPAGES; page++) {
+		if (journal_pages[page/32] & (1 << (page%32))) n++;
+	}
+	return n;
+}
+
+/*
+ * @brief  Records the manifest of the image just installed
+ * @param  build ID, install time, CRC-32 of the image
+ * @retval 0 if successful
+ * 		  -1 if the journal could not be written
+ */
+int32_t journal_install(uint32_t build, uint32_t time, uint32_t crc) {
+	journal_load();
+	/* Room for the three records, so that no compaction splits them. */
+	if (journal_next + 3*JOURNAL_RECORDSIZE > JOURNALtop && journal_compact() == -1) return -1;
+	if (journal_next + 3*JOURNAL_RECORDSIZE > JOURNALtop) return -1;
+	if (journal_append(JOURNAL_TAG_BUILD, build) == -1) return -1;
+	if (journal_append(JOURNAL_TAG_TIME, time) == -1) return -1;
+	if (journal_append(JOURNAL_TAG_INSTALLED, crc) == -1) return -1;
+	journal_installed.build = build;
+	journal_installed.time = time;
+	journal_installed.crc = crc;
+	journal_hasmanifest = 1;
+	return 0;
+}
+
+/*
+ * @brief  Manifest of the installed image, as last recorded
+ * @param  manifest to fill in
+ * @retval 0 if one was recorded
+ * 		  -1 if none
+ */
+int32_t journal_manifest(manifest_t *m) {
+	journal_load();
+	if (!journal_hasmanifest) return -1;
+	*m = journal_installed;
+	return 0;
+}
+
+/*
+ * @brief  Appends a record, compacting the journal if it is full. The value is
+ *         programmed before the tag, so that a reset in between leaves a torn
+ *         record that journal_load() skips.
+ * @param  tag, value
+ * @retval 0 if successful
+ * 		  -1 if not successful
+ */
+int32_t journal_append(uint32_t tag, uint32_t value) {
+	if (journal_next >= JOURNALtop && journal_compact() == -1) return -1;
+	if (journal_next >= JOURNALtop) return -1;
+	if (FLASH_ProgramWord(journal_next + 4, value) != FLASH_COMPLETE) return -1;
+	if (FLASH_ProgramWord(journal_next, tag) != FLASH_COMPLETE) return -1;
+	journal_next += JOURNAL_RECORDSIZE;
+	return 0;
+}
+
+/*
+ * @brief  Erases the journal pages
+ * @param  void
+ * @retval 0 if successful
+ * 		  -1 if not successful
+ */
+int32_t journal_erase(void) {
+	uint32_t page;
+	for (page = JOURNALbase; page < JOURNALtop; page += FLASHPAGESIZE) {
+		if (FLASH_ErasePage(page) != FLASH_COMPLETE) return -1;
+	}
+	journal_next = JOURNALbase;
+	return 0;
+}
+
+/*
+ * @brief  Rewrites a full journal as the image record, one record per verified page
+ *         and the manifest records
+ * @param  void
+ * @retval 0 if successful
+ * 		  -1 if not successful; the progress is lost, not the image
+ */
+int32_t journal_compact(void) {
+	uint32_t page;
+
+	if (journal_erase() == -1) return -1;
+	if (journal_currentimage != JOURNAL_NOIMAGE) {
+		if (journal_append(JOURNAL_TAG_IMAGE, journal_currentimage) == -1) return -1;
+		for (page = 0; page < JOURNAL_MAXPAGES; page++) {
+			if (!(journal_pages[page/32] & (1 << (page%32)))) continue;
+			if (journal_append(JOURNAL_TAG_PAGE | page, hil_crc32(FLASHbase + page*FLASHPAGESIZE, FLASHPAGESIZE)) == -1) return -1;
+		}
+	}
+	return journal_keepmanifest();
+}
+
+/*
+ * @brief  Appends the manifest records again after an erase of the journal
+ * @param  void
+ * @retval 0 if successful, or if there is no manifest
+ * 		  -1 if not successful
+ */
+int32_t journal_keepmanifest(void) {
+	if (!journal_hasmanifest) return 0;
+	if (journal_append(JOURNAL_TAG_BUILD, journal_installed.build) == -1) return -1;
+	if (journal_append(JOURNAL_TAG_TIME, journal_installed.time) == -1) return -1;
+	return journal_append(JOURNAL_TAG_INSTALLED, journal_installed.crc);
+}
+
+/**
+  * @}
+  */
+
+/**************************** Politecnico di Milano ************END OF FILE****/
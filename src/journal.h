@@ -0,0 +1,68 @@
+/**
+  ******************************************************************************
+  * @file    CBBL_usart/src/journal.h
+  * @author  Marco Zavatta, Yin Zhining
+  * @version V1.0
+  * @date    03/04/2012
+  * @brief   Update progress journal
+  ******************************************************************************
+  */
+
+#include "includes.h"
+#include "hil.h"
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * The journal keeps the progress of an update across dropped sessions and
+ * resets. It is a log of two-word records appended to the JOURNALPAGES pages
+ * at JOURNALbase, out of the application area: an image record opens the
+ * update of an image ID, then a page record is appended for every page found
+ * verified. The pages are erased only when a new image is opened or, should
+ * they fill up, to compact the log.
+ *
+ * Once the image is installed, the host records its build ID and install time
+ * with journal_install(): the manifest records, bound to the image CRC-32 by the
+ * last of them, so that the manifest is only reported for the image it was
+ * recorded for.
+ */
+
+/* Record tags, first word of a record; the second word is the value. */
+#define JOURNAL_TAG_IMAGE		(0xA5000000)	/* value: image ID */
+#define JOURNAL_TAG_PAGE		(0x5A000000)	/* | page index, value: CRC-32 of the page */
+#define JOURNAL_TAG_BUILD		(0x3C000000)	/* value: build ID of the installed image */
+#define JOURNAL_TAG_TIME		(0x3D000000)	/* value: install time, as sent by the host */
+#define JOURNAL_TAG_INSTALLED	(0x3E000000)	/* value: image CRC-32, written last */
+#define JOURNAL_TAG_MASK		(0xFF000000)
+#define JOURNAL_FREE			(0xFFFFFFFF)
+
+#define JOURNAL_NOIMAGE			(0xFFFFFFFF)
+#define JOURNAL_RECORDSIZE		(8)
+#define JOURNALtop				(JOURNALbase + JOURNALPAGES*FLASHPAGESIZE)
+#define JOURNAL_MAXPAGES		((FLASHtop + 1 - FLASHbase)/FLASHPAGESIZE)
+
+/* Manifest of the installed image, as recorded by journal_install(). */
+typedef struct {
+	uint32_t build;					/* build ID */
+	uint32_t time;					/* install time */
+	uint32_t crc;					/* CRC-32 of the image, see image.h */
+} manifest_t;
+
+/* Exported functions ------------------------------------------------------- */
+void journal_load(void);
+int32_t journal_open(uint32_t image);
+int32_t journal_commit(uint32_t addr, uint32_t length, uint32_t crc);
+uint32_t journal_image(void);
+uint32_t journal_firstincomplete(void);
+uint32_t journal_verified(void);
+int32_t journal_install(uint32_t build, uint32_t time, uint32_t crc);
+int32_t journal_manifest(manifest_t *m);
+
+/* Function prototypes ------------------------------------------------------ */
+int32_t journal_append(uint32_t tag, uint32_t value);
+int32_t journal_erase(void);
+int32_t journal_compact(void);
+int32_t journal_keepmanifest(void);
+
+#endif /* JOURNAL_H */
@@ -0,0 +1,155 @@
+/**
+  ******************************************************************************
+  * @file    CBBL_usart/src/log.c
+  * @author  Marco Zavatta, Yin Zhining
+  * @version V1.0
+  * @date    03/04/2012
+  * @brief   RAM log
+  ******************************************************************************
+  */
+
+#include "log.h"
+
+/** @addtogroup CBBL
+  * @{
+  */
+
+/* USART2 belongs to the application the update agent is linked into. */
+#ifdef CBBL_AGENT
+#undef LOG_USART2
+#endif
+
+#define LOG_MASK				(LOG_SIZE - 1)
+
+/* Ring buffer, addressed by byte positions masked with LOG_MASK. */
+uint8_t log_ring[LOG_SIZE];
+uint32_t log_head;					/* position of the next byte logged */
+uint32_t log_tail;					/* position of the oldest record kept */
+uint32_t log_lost;					/* records not logged, the bytes they needed being sent */
+
+#ifdef LOG_USART2
+uint32_t log_sent;					/* position of the next byte to send to USART2 */
+uint32_t log_inflight;				/* bytes being sent by DMA1 channel 7 */
+#endif
+
+/*
+ * @brief  Starts the USART2 sink, if built in: USART2 at LOG_BAUD on PD5, TX only
+ * @param  void
+ * @retval void
+ */
+void log_init(void) {
+#ifdef LOG_USART2
+	RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+	RCC->APB2ENR |= RCC_APB2ENR_IOPDEN | RCC_APB2ENR_AFIOEN;
+	RCC->APB1ENR |= RCC_APB1ENR_USART2EN;
+	AFIO->MAPR |= AFIO_MAPR_USART2_REMAP;
+
+	/* PD5 as alternate function push-pull: bits 20-23 to 1011=B. */
+	GPIOD->CRL = (GPIOD->CRL & 0xFF0FFFFF) | 0x00B00000;
+
+	/* USART2 is on APB1, at half the core clock. */
+	USART2->BRR = (SystemCoreClock/2 + LOG_BAUD/2) / LOG_BAUD;
+	USART2->CR3 = USART_CR3_DMAT;
+	USART2->CR1 = USART_CR1_UE | USART_CR1_TE;
+
+	log_sent = log_tail;
+	log_inflight = 0;
+#endif
+}
+
+/*
+ * @brief  Logs a text, never blocking: cut at LOG_MAXTEXT, line ends and trailing
+ *         blanks left out, nothing logged if nothing is left, the oldest records
+ *         dropped to make room
+ * @param  text
+ * @retval void
+ */
+void log_text(const char *text) {
+	uint32_t n = 0, size, cycles = hil_cycles(), i;
+
+	while (n < LOG_MAXTEXT && text[n] != '\0') n++;
+	while (n > 0 && (text[n-1] == '\r' || text[n-1] == '\n' || text[n-1] == ' ')) n--;
+	if (n == 0) return;
+	size = LOG_HEADERSIZE + n;
+
+#ifdef LOG_USART2
+	/* Bytes being sent by DMA are not overwritten. */
+	if (log_inflight != 0 && log_head + size - log_sent > LOG_SIZE) {
+		log_lost++;
+		return;
+	}
+#endif
+	while (log_head + size - log_tail > LOG_SIZE) {
+		log_tail += LOG_HEADERSIZE + log_ring[(log_tail + 4) & LOG_MASK];
+	}
+
+	for (i = 0; i < 4; i++) log_ring[(log_head++) & LOG_MASK] = (uint8_t)(cycles >> 8*i);
+	log_ring[(log_head++) & LOG_MASK] = (uint8_t)n;
+	for (i = 0; i < n; i++) log_ring[(log_head++) & LOG_MASK] = (uint8_t)text[i];
+}
+
+/*
+ * @brief  Copies whole records from a position on, without removing them
+ * @param  position to read from, moved to the oldest record kept if that one is
+ *         gone or is past the last record; output, its capacity
+ * @retval bytes copied, the next position to read from being *from plus them
+ */
+uint32_t log_read(uint32_t *from, uint8_t *out, uint32_t cap) {
+	uint32_t pos = *from, n = 0, size, i;
+
+	if (pos - log_tail > log_head - log_tail) pos = log_tail;
+	*from = pos;
+	while (pos != log_head) {
+		size = LOG_HEADERSIZE + log_ring[(pos + 4) & LOG_MASK];
+		if (n + size > cap) break;
+		for (i = 0; i < size; i++) out[n++] = log_ring[(pos++) & LOG_MASK];
+	}
+	return n;
+}
+
+/*
+ * @brief  Records not logged for lack of room, see log_text()
+ * @param  void
+ * @retval number of records
+ */
+uint32_t log_dropped(void) {
+	return log_lost;
+}
+
+/*
+ * @brief  Serves the USART2 sink, if built in: once a DMA transfer is over, starts
+ *         the next one with the bytes logged meanwhile, up to the end of the ring
+ * @param  void
+ * @retval void
+ */
+void log_drain(void) {
+#ifdef LOG_USART2
+	uint32_t n;
+
+	if (log_inflight != 0) {
+		if (!(DMA1->ISR & DMA_ISR_TCIF7)) return;
+		DMA1_Channel7->CCR = 0;
+		DMA1->IFCR = DMA_IFCR_CGIF7;
+		log_sent += log_inflight;
+		log_inflight = 0;
+	}
+
+	/* Records dropped before being sent are skipped. */
+	if (log_sent - log_tail > log_head - log_tail) log_sent = log_tail;
+	if (log_sent == log_head) return;
+
+	n = log_head - log_sent;
+	if (n > LOG_SIZE - (log_sent & LOG_MASK)) n = LOG_SIZE - (log_sent & LOG_MASK);
+	log_inflight = n;
+	DMA1_Channel7->CPAR = (uint32_t)&USART2->DR;
+	DMA1_Channel7->CMAR = (uint32_t)&log_ring[log_sent & LOG_MASK];
+	DMA1_Channel7->CNDTR = n;
+	DMA1_Channel7->CCR = DMA_CCR7_MINC | DMA_CCR7_DIR | DMA_CCR7_EN;
+#endif
+}
+
+/**
+  * @}
+  */
+
+/**************************** Politecnico di Milano ************END OF FILE****/
@@ -0,0 +1,45 @@
+/**
+  ******************************************************************************
+  * @file    CBBL_usart/src/log.h
+  * @author  Marco Zavatta, Yin Zhining
+  * @version V1.0
+  * @date    03/04/2012
+  * @brief   RAM log
+  ******************************************************************************
+  */
+
+#include "includes.h"
+#include "hil.h"
+
+#ifndef LOG_H
+#define LOG_H
+
+/* Background sink: uncomment to send the log out of USART2 by DMA. */
+//#define LOG_USART2
+
+/*
+ * Log records are short texts kept in a RAM ring buffer, never sent on the
+ * transports of the protocol: the cycle count at logging time (see hil_cycles()),
+ * LSB first, a length byte, then the text. When the ring is full the oldest
+ * records go. Bytes are numbered from the first one ever logged, so a reader
+ * keeps its own position across reads: the log command (see commands.c) and,
+ * with LOG_USART2, a DMA drain to USART2 served by log_drain(). The records
+ * are written from the main loop only.
+ *
+ * USART2 is remapped to PD5 (TX) / PD6 (RX), PA2 driving an LED: the sink
+ * needs a package with port D.
+ */
+
+#define LOG_SIZE				(1024)		/* power of 2 */
+#define LOG_MAXTEXT				(48)		/* longer texts are cut */
+#define LOG_HEADERSIZE			(5)			/* cycle count, length */
+#define LOG_BAUD				(115200)
+
+/* Exported functions ------------------------------------------------------- */
+void log_init(void);
+void log_text(const char *text);
+uint32_t log_read(uint32_t *from, uint8_t *out, uint32_t cap);
+uint32_t log_dropped(void);
+void log_drain(void);
+
+#endif /* LOG_H */
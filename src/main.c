@@ -36,14 +36,36 @@ CAN_TypeDef *CanStat;
   */
 int main(void)
 {
-  /* Initialize. */
-  hil_init();
-  cal_init();
+  /* Initialize only what the boot decision needs: backup registers, FLASH and button. */
+  hil_bootinit();
 
   /* Which kind of reset was it? */
   int8_t resettype;
   resettype = hil_isSWreset();
 
+  /* Did the application request entry through the mailbox, or did the bootloader reset itself? */
+  uint8_t transport = 0, opcode = 0, t;
+  uint32_t baud = 0, window = COMMAND_LISTENWINDOW, app = 0;
+  int32_t mailbox, image = SLOT_IMAGE_NONE;
+  mailbox = hil_takemailbox(&transport, &baud, &window, &opcode);
+
+  /* Fast path: nothing asks to stay, or the update agent asks to boot its slot,
+   * boot without initializing any other peripheral. */
+  if ((mailbox == HIL_ENTRY_BOOT || (mailbox == HIL_ENTRY_NONE && resettype == 0)) && (GPIOB->IDR & GPIO_IDR_IDR1) != 0x00)
+  {
+	app = slot_boot();
+	image = slot_checkimage(app);
+	if (image >= SLOT_IMAGE_NONE) {
+		hil_recordboot();
+		jumptoapp(app);
+	}
+  }
+
+  /* Initialize. */
+  hil_init();
+  cal_init();
+  log_init();
+
   cal_SENDLOG("\r\n");
   cal_SENDLOG("=========CBBL Log=========\r\n");
   cal_SENDLOG("Marco Zavatta, Yin Zhining\r\n");
@@ -54,22 +76,34 @@ int main(void)
   //CanStat = CAN1;
 
 
-  // NEED TO SAVE THE STATE TO RE-ENTER THE SAME COMMUNICATION DEVICE AFTER THE SW-TRIGGERED RESET
-  /* Test if button on the board is pressed during reset or if it was a sw-triggered reset. */
-  if (((GPIOB->IDR & GPIO_IDR_IDR1) == 0x00 && resettype == 0) || resettype == 1)
-  { 
-	//comm_peripheral = USART;
-	if (resettype==1) {
-		GPIOA->BSRR |= GPIO_BSRR_BS0 | GPIO_BSRR_BS1 | GPIO_BSRR_BS2 | GPIO_BSRR_BR3;
-		cal_SENDLOG("-> software reset occured \r\n");
-	}
-	else	{
-		GPIOA->BSRR |= GPIO_BSRR_BS0 | GPIO_BSRR_BS1 | GPIO_BSRR_BR2 | GPIO_BSRR_BR3;
-		cal_SENDLOG("-> button pressed \r\n");
+  /* Entry was requested, button on the board is pressed during reset or it was a sw-triggered reset. */
+  //comm_peripheral = USART;
+  if (mailbox == HIL_ENTRY_REQUESTED || mailbox == HIL_ENTRY_RESUMED) {
+	GPIOA->BSRR |= GPIO_BSRR_BR0 | GPIO_BSRR_BS1 | GPIO_BSRR_BS2 | GPIO_BSRR_BR3;
+	cal_SENDLOG("-> entry requested \r\n");
+	for (t = 1; t <= CAL_TRANSPORTS && baud != 0; t++) {
+		if (transport == 0 || t == transport) cal_baudrate(t, baud);
 	}
-
-	command_receiveinit();
   }
+  else if (app != 0 && image == SLOT_IMAGE_ERASED) {
+	GPIOA->BSRR |= GPIO_BSRR_BS0 | GPIO_BSRR_BR1 | GPIO_BSRR_BR2 | GPIO_BSRR_BR3;
+	cal_SENDLOG("-> no image \r\n");
+  }
+  else if (app != 0) {
+	GPIOA->BSRR |= GPIO_BSRR_BS0 | GPIO_BSRR_BR1 | GPIO_BSRR_BS2 | GPIO_BSRR_BR3;
+	cal_SENDLOG("-> image not valid \r\n");
+  }
+  else if (resettype==1) {
+	GPIOA->BSRR |= GPIO_BSRR_BS0 | GPIO_BSRR_BS1 | GPIO_BSRR_BS2 | GPIO_BSRR_BR3;
+	cal_SENDLOG("-> software reset occured \r\n");
+  }
+  else	{
+	GPIOA->BSRR |= GPIO_BSRR_BS0 | GPIO_BSRR_BS1 | GPIO_BSRR_BR2 | GPIO_BSRR_BR3;
+	cal_SENDLOG("-> button pressed \r\n");
+  }
+
+  /* No host within the listen window: the application is booted anyway. */
+  command_receiveinit(transport, window, (mailbox == HIL_ENTRY_RESUMED) ? opcode : COMMAND_NORESUME);
    /*else*/
 
 
@@ -88,12 +122,20 @@ int main(void)
   }*/
 
   /* Keep the user application running */
-  else
-  {
-	cal_SENDLOG("-> button not pressed, jumping to app\r\n");
-	/* Jump to pre-loaded application. */
-	jumptoapp(FLASHbase);
+  cal_SENDLOG("-> jumping to app\r\n");
+  /* Jump to pre-loaded application, in the active slot. */
+  if (app == 0) app = slot_boot();
+  /* Nothing bootable, an erased or half-erased slot included: keep serving the host,
+   * picking the slot again once it is gone, the host may have activated another. */
+  while ((image = slot_checkimage(app)) < SLOT_IMAGE_NONE) {
+	if (image == SLOT_IMAGE_ERASED) cal_SENDLOG("-> no image \r\n");
+	else cal_SENDLOG("-> image not valid \r\n");
+	command_receiveinit(0, window, COMMAND_NORESUME);
+	app = slot_boot();
   }
+  hil_recordboot();
+  jumptoapp(app);
+
   while (1)
   {
 	cal_SENDLOG("-> !!! main function fail !!!\r\n");
@@ -111,15 +153,6 @@ int main(void)
 }
 
 
-int32_t CANburst() {
-		uint32_t number=255, i;
-	    /* Send Data. */
-	  	for (i = 0;i < (number+1);i++) {
-	  		cal_SENDBYTE((uint8_t)i);
-	  	}
-	  	return 0;
-}
-
 /**************************** Politecnico di Milano ************END OF FILE****/
 
 
@@ -0,0 +1,84 @@
+/**
+  ******************************************************************************
+  * @file    CBBL_usart/src/profile.c
+  * @author  Marco Zavatta, Yin Zhining
+  * @version V1.0
+  * @date    03/04/2012
+  * @brief   Command phase profiling
+  ******************************************************************************
+  */
+
+#include "profile.h"
+
+/** @addtogroup CBBL
+  * @{
+  */
+
+#ifdef CBBL_PROFILE
+/* Histograms, one per kind of phase. */
+profilehist_t profile_hist[PROFILE_KINDS];
+
+/* Start of the phase being timed by profile_start(), per kind. */
+uint32_t profile_since[PROFILE_KINDS];
+
+/*
+ * @brief  Starts timing a phase of a kind only ever timed from the main loop
+ * @param  kind (PROFILE_*)
+ * @retval void
+ */
+void profile_start(uint8_t kind) {
+	profile_since[kind] = hil_cycles();
+}
+
+/*
+ * @brief  Stops timing the phase started by profile_start() and records it
+ * @param  kind (PROFILE_*)
+ * @retval void
+ */
+void profile_stop(uint8_t kind) {
+	profile_record(kind, hil_cycles() - profile_since[kind]);
+}
+
+/*
+ * @brief  Records a phase in the histogram of its kind
+ * @param  kind (PROFILE_*), cycles the phase took
+ * @retval void
+ */
+void profile_record(uint8_t kind, uint32_t cycles) {
+	profilehist_t *h = &profile_hist[kind];
+	uint8_t bucket = 0;
+
+	if (cycles > h->max) h->max = cycles;
+	while (bucket < PROFILE_BUCKETS - 1 && (cycles >> (bucket + 1)) != 0) bucket++;
+	h->buckets[bucket]++;
+	h->count++;
+}
+
+/*
+ * @brief  Histogram of a kind of phase
+ * @param  kind (PROFILE_*)
+ * @retval histogram, 0 if no such kind
+ */
+profilehist_t *profile_get(uint8_t kind) {
+	if (kind >= PROFILE_KINDS) return 0;
+	return &profile_hist[kind];
+}
+
+/*
+ * @brief  Clears the histograms
+ * @param  void
+ * @retval void
+ */
+void profile_reset(void) {
+	uint32_t i;
+	uint8_t *p = (uint8_t *)profile_hist;
+
+	for (i = 0; i < sizeof(profile_hist); i++) p[i] = 0;
+}
+#endif
+
+/**
+  * @}
+  */
+
+/**************************** Politecnico di Milano ************END OF FILE****/
@@ -0,0 +1,62 @@
+/**
+  ******************************************************************************
+  * @file    CBBL_usart/src/profile.h
+  * @author  Marco Zavatta, Yin Zhining
+  * @version V1.0
+  * @date    03/04/2012
+  * @brief   Command phase profiling
+  ******************************************************************************
+  */
+
+#include "includes.h"
+#include "hil.h"
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/* Instrumentation build: uncomment to time the command phases. */
+//#define CBBL_PROFILE
+
+/*
+ * The instrumentation build times the phases of every command with the DWT
+ * cycle counter (see hil_cycles()) and keeps a histogram per kind of phase:
+ * bucket i counts the phases that took 2^i to 2^(i+1)-1 cycles, bucket 0 also
+ * counting those that took none. Other builds leave the macros empty.
+ */
+
+/* Kinds of phase. */
+#define PROFILE_RECEIVE			(0)		/* bytes of a phase, first to last */
+#define PROFILE_CHECKSUM		(1)		/* checksum of a phase, once complete */
+#define PROFILE_FLASH			(2)		/* a FLASH program or erase operation */
+#define PROFILE_RESPONSE		(3)		/* a handler step: validation, execution and reply */
+#define PROFILE_KINDS			(4)
+
+#define PROFILE_BUCKETS			(32)
+
+typedef struct {
+	uint32_t count;					/* phases timed */
+	uint32_t max;					/* cycles of the longest one */
+	uint32_t buckets[PROFILE_BUCKETS];
+} profilehist_t;
+
+#ifdef CBBL_PROFILE
+/* Time a phase of a kind run from the main loop only, or from a variable. */
+#define PROFILE_START(k)		profile_start(k)
+#define PROFILE_STOP(k)			profile_stop(k)
+#define PROFILE_MARK(v)			(v) = hil_cycles()
+#define PROFILE_SINCE(k, v)		profile_record(k, hil_cycles() - (v))
+#else
+#define PROFILE_START(k)
+#define PROFILE_STOP(k)
+#define PROFILE_MARK(v)
+#define PROFILE_SINCE(k, v)
+#endif
+
+/* Exported functions ------------------------------------------------------- */
+void profile_start(uint8_t kind);
+void profile_stop(uint8_t kind);
+void profile_record(uint8_t kind, uint32_t cycles);
+profilehist_t *profile_get(uint8_t kind);
+void profile_reset(void);
+
+#endif /* PROFILE_H */
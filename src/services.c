@@ -0,0 +1,69 @@
+/**
+  ******************************************************************************
+  * @file    CBBL_usart/src/services.c
+  * @author  Marco Zavatta, Yin Zhining
+  * @version V1.0
+  * @date    03/04/2012
+  * @brief   Bootloader service table
+  ******************************************************************************
+  */
+
+#include "services.h"
+#include "commands.h"
+#include "slot.h"
+
+/** @addtogroup CBBL
+  * @{
+  */
+
+/*
+ * @brief  FLASH entries of the service table: the image the application rewrites
+ *         is forgotten first (see slot_forgetimage()), so that the next boot
+ *         checks it again
+ * @param  as hil_erasecorrespondingpage(), hil_writepage(), hil_fill()
+ * @retval as hil_erasecorrespondingpage(), hil_writepage(), hil_fill()
+ */
+int32_t services_erasepage(int32_t addr) {
+	slot_forgetimage();
+	return hil_erasecorrespondingpage(addr);
+}
+
+int32_t services_writepage(uint32_t pageaddr, uint32_t *data) {
+	slot_forgetimage();
+	return hil_writepage(pageaddr, data);
+}
+
+int32_t services_fill(uint32_t addr, uint32_t length, uint32_t pattern) {
+	slot_forgetimage();
+	return hil_fill(addr, length, pattern);
+}
+
+/* Service table, placed at SERVICESbase by the linker scripts. */
+const services_t services __attribute__ ((section(".services"), used)) = {
+	SERVICES_MAGIC,
+	SERVICES_VERSION,
+	sizeof(services_t),
+
+	hil_FPECenable,
+	services_erasepage,
+	services_writepage,
+	services_fill,
+
+	hil_crc32,
+	calculatechecksum,
+
+	cal_transportinit,
+	cal_txbyte,
+	cal_rxbyte,
+	cal_receivebyte,
+	cal_txblock,
+	cal_waitblock,
+
+	hil_requestentry,
+};
+
+/**
+  * @}
+  */
+
+/**************************** Politecnico di Milano ************END OF FILE****/
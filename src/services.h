@@ -0,0 +1,68 @@
+/**
+  ******************************************************************************
+  * @file    CBBL_usart/src/services.h
+  * @author  Marco Zavatta, Yin Zhining
+  * @version V1.0
+  * @date    03/04/2012
+  * @brief   Bootloader service table
+  ******************************************************************************
+  */
+
+#include <stdint.h>
+
+#ifndef SERVICES_H
+#define SERVICES_H
+
+/*
+ * The bootloader exports its FLASH, CRC and transport routines to applications
+ * through a table of function pointers at the fixed address SERVICESbase (see
+ * the linker scripts), in the manner of a ROM API. This header is all an
+ * application needs: it checks magic and version, then calls through SERVICES.
+ *
+ * Entries are only ever appended, SERVICES_VERSION being bumped each time, so
+ * an application requiring version n works with any bootloader of version >= n.
+ * The routines keep no state in RAM, the application's RAM being theirs while
+ * they run: FLASH writes and erases are confined to the application area and
+ * clear the boot-time image check caches in the backup registers (enabling the
+ * PWR and BKP clocks and backup domain access to do so), and the transport
+ * routines expect the transport initialized by cal_init, which
+ * only configures USART1 (PA9, PA10) and CAN1 (PB8, PB9), read-modify-writing
+ * their pins. The routines use DMA1 channel 1 (crc32, a memory-to-memory
+ * transfer) and DMA1 channel 4 (cal_sendblock, and cal_sendbyte waiting for
+ * it), which the application must leave free while it calls them.
+ */
+
+#define SERVICESbase			(0x08000200)
+#define SERVICES_MAGIC			(0x43424253)	/* "CBBS" */
+#define SERVICES_VERSION		(2)
+
+#define SERVICES				((const services_t *)SERVICESbase)
+
+typedef struct {
+	uint32_t magic;													/* SERVICES_MAGIC */
+	uint16_t version;												/* SERVICES_VERSION */
+	uint16_t size;													/* sizeof(services_t) */
+
+	/* Version 1: FLASH, see hil.c. */
+	void (*flash_unlock)(void);										/* hil_FPECenable */
+	int32_t (*flash_erasepage)(int32_t addr);						/* hil_erasecorrespondingpage */
+	int32_t (*flash_writepage)(uint32_t pageaddr, uint32_t *data);	/* hil_writepage */
+	int32_t (*flash_fill)(uint32_t addr, uint32_t length, uint32_t pattern);	/* hil_fill */
+
+	/* Version 1: CRC and checksum. */
+	uint32_t (*crc32)(uint32_t addr, uint32_t length);				/* hil_crc32 */
+	uint8_t (*checksum)(uint8_t *data, uint32_t length);			/* calculatechecksum */
+
+	/* Version 1: transport, see cal.c. */
+	int32_t (*cal_init)(void);										/* cal_transportinit, -1 if CAN is not up */
+	int32_t (*cal_sendbyte)(uint8_t t, uint8_t b);					/* cal_txbyte */
+	int32_t (*cal_pollbyte)(uint8_t t, uint8_t *c);					/* cal_rxbyte */
+	int32_t (*cal_receivebyte)(uint8_t t, uint8_t *c, uint32_t timeout);
+	int32_t (*cal_sendblock)(uint8_t t, uint8_t *data, uint32_t n);	/* cal_txblock */
+	void (*cal_waitblock)(uint8_t t);
+
+	/* Version 2: bootloader entry. */
+	void (*bootrequest)(uint8_t transport, uint32_t baud, uint32_t window);	/* hil_requestentry, window at most 65535 ms */
+} services_t;
+
+#endif /* SERVICES_H */
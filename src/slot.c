@@ -0,0 +1,344 @@
+/**
+  ******************************************************************************
+  * @file    CBBL_usart/src/slot.c
+  * @author  Marco Zavatta, Yin Zhining
+  * @version V1.0
+  * @date    03/04/2012
+  * @brief   Application slots
+  ******************************************************************************
+  */
+
+#include "slot.h"
+
+/** @addtogroup CBBL
+  * @{
+  */
+
+#ifdef DUALSLOT
+/* Metadata state, rebuilt from the FLASH by slot_load(). */
+slotrecord_t slot_latest;			/* active slot */
+slotrecord_t slot_fallback;			/* latest record of the other slot, rolled back to */
+uint32_t slot_next;					/* first free record in the page of the latest one */
+#endif
+
+/*
+ * @brief  Picks the slot to boot, rolling back to the previous one if the active
+ *         slot is not valid or did not confirm SLOT_MAXTRIES boots
+ * @param  void
+ * @retval base address of the slot to boot, SLOT_NOBOOT if neither slot is valid
+ */
+uint32_t slot_boot(void) {
+#ifdef DUALSLOT
+	uint16_t boots;
+	int32_t valid;
+	slotrecord_t back;
+
+	slot_takerequest();
+	slot_load();
+	if (slot_latest.slot == SLOT_NONE) return SLOTAbase;
+
+	boots = hil_readbkp(HIL_BKP_BOOTCOUNT) + 1;
+	valid = slot_validboot(&slot_latest);
+	if ((boots > SLOT_MAXTRIES || valid != 1) &&
+		slot_fallback.slot != SLOT_NONE && slot_validboot(&slot_fallback) == 1) {
+		back = slot_fallback;
+		back.sequence = slot_latest.sequence + 1;
+		if (slot_append(&back) == 0) {
+			boots = 1;
+			valid = 1;
+		}
+	}
+	hil_writebkp(HIL_BKP_BOOTCOUNT, boots);
+	if (valid != 1) return SLOT_NOBOOT;
+	hil_bootvalidated(slot_latest.slot, slot_latest.length, slot_latest.crc);
+	return slot_base(slot_latest.slot);
+#else
+	return FLASHbase;
+#endif
+}
+
+/*
+ * @brief  Checks the image to boot: its vector table (initial stack pointer in the
+ *         RAM, reset vector in Thumb state inside the slot), then its image header,
+ *         if any: the CRC-32 of the image, by DMA, unless the image was found valid
+ *         at a previous boot
+ * @param  image base address, or SLOT_NOBOOT (SLOT_IMAGE_BAD)
+ * @retval SLOT_IMAGE_VALID, SLOT_IMAGE_NONE, SLOT_IMAGE_BAD or SLOT_IMAGE_ERASED
+ */
+int32_t slot_checkimage(uint32_t base) {
+	const imageheader_t *h;
+	uint32_t end = IMAGE_HEADEROFFSET + sizeof(imageheader_t);
+	uint32_t sp, reset;
+	uint16_t key;
+
+	if (base == SLOT_NOBOOT) return SLOT_IMAGE_BAD;
+	sp = hil_readFLASH(base);
+	reset = hil_readFLASH(base + 4);
+	if (sp == 0xFFFFFFFF) return SLOT_IMAGE_ERASED;
+	if (sp <= SRAM_BASE || sp > RAMtop || (sp & 0x3) != 0 ||
+		(reset & 0x1) == 0 || reset < base || reset >= base + SLOT_IMAGESIZE) return SLOT_IMAGE_BAD;
+
+	h = slot_header(base);
+	if (h == 0) return SLOT_IMAGE_NONE;
+	if (h->length < end || h->length > SLOT_IMAGESIZE || (h->length & 0x3) != 0) return SLOT_IMAGE_BAD;
+
+	key = slot_imagekey(base, h->length, h->crc);
+	if (hil_readbkp(HIL_BKP_IMAGECACHE) != key) {
+		hil_crc32(base, IMAGE_HEADEROFFSET);
+		if (hil_crc32feed(base + end, h->length - end) != h->crc) {
+			hil_writebkp(HIL_BKP_IMAGECACHE, 0);
+			return SLOT_IMAGE_BAD;
+		}
+		hil_writebkp(HIL_BKP_IMAGECACHE, key);
+	}
+#ifndef DUALSLOT
+	/* With DUALSLOT the slot record already validated the image. */
+	hil_bootvalidated(SLOT_A, h->length, h->crc);
+#endif
+	return SLOT_IMAGE_VALID;
+}
+
+/*
+ * @brief  Image header of an image, not checked against the image
+ * @param  image base address
+ * @retval header, 0 if the image has none
+ */
+const imageheader_t *slot_header(uint32_t base) {
+	const imageheader_t *h = (const imageheader_t *)(base + IMAGE_HEADEROFFSET);
+	return (h->magic == IMAGE_MAGIC) ? h : 0;
+}
+
+/*
+ * @brief  Forgets the image and the slot record found valid, the FLASH being about
+ *         to change
+ * @param  void
+ * @retval void
+ */
+void slot_forgetimage(void) {
+	hil_bkpinit();
+	hil_writebkp(HIL_BKP_IMAGECACHE, 0);
+#ifdef DUALSLOT
+	hil_writebkp(HIL_BKP_SLOTCACHE, 0);
+#endif
+}
+
+/*
+ * @brief  Activates a slot holding a validated image, with a single metadata record
+ * @param  slot (SLOT_A, SLOT_B), image length in bytes, image CRC-32
+ * @retval 0 if successful
+ * 		  -1 if the image does not match or the record could not be written
+ */
+int32_t slot_activate(uint8_t slot, uint32_t length, uint32_t crc) {
+#ifdef DUALSLOT
+	slotrecord_t r;
+
+	slot_load();
+	r.slot = slot;
+	r.length = length;
+	r.crc = crc;
+	r.sequence = (slot_latest.slot == SLOT_NONE) ? 0 : slot_latest.sequence + 1;
+	if (slot > SLOT_B || slot_valid(&r) != 1) return -1;
+#ifdef CBBL_AGENT
+	hil_writebkp(HIL_BKP_LENGTHHI, length >> 16);
+	hil_writebkp(HIL_BKP_LENGTHLO, length & 0xFFFF);
+	hil_writebkp(HIL_BKP_CRCHI, crc >> 16);
+	hil_writebkp(HIL_BKP_CRCLO, crc & 0xFFFF);
+	hil_writebkp(HIL_BKP_REQUEST, SLOT_REQUEST | slot);
+#else
+	if (slot_append(&r) == -1) return -1;
+	hil_writebkp(HIL_BKP_BOOTCOUNT, 0);
+#endif
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * @brief  Active slot
+ * @param  void
+ * @retval SLOT_A or SLOT_B
+ */
+uint8_t slot_active(void) {
+#ifdef DUALSLOT
+	slot_load();
+	if (slot_latest.slot != SLOT_NONE) return slot_latest.slot;
+#endif
+	return SLOT_A;
+}
+
+/*
+ * @brief  Base address of a slot
+ * @param  slot (SLOT_A, SLOT_B)
+ * @retval address
+ */
+uint32_t slot_base(uint8_t slot) {
+#ifdef DUALSLOT
+	if (slot == SLOT_B) return SLOTBbase;
+	return SLOTAbase;
+#else
+	return FLASHbase;
+#endif
+}
+
+/*
+ * @brief  Base address of the slot new images are written to
+ * @param  void
+ * @retval address, FLASHbase itself without DUALSLOT
+ */
+uint32_t slot_inactivebase(void) {
+	return slot_base(slot_active() == SLOT_A ? SLOT_B : SLOT_A);
+}
+
+#ifdef DUALSLOT
+/*
+ * @brief  Activates the image whose activation the update agent requested, if any;
+ *         the request is consumed whatever the outcome
+ * @param  void
+ * @retval void
+ */
+void slot_takerequest(void) {
+	uint16_t request = hil_readbkp(HIL_BKP_REQUEST);
+
+	if ((request & SLOT_REQUEST_MASK) != SLOT_REQUEST) return;
+	hil_writebkp(HIL_BKP_REQUEST, 0);
+	slot_activate(request & 0xFF,
+				  ((uint32_t)hil_readbkp(HIL_BKP_LENGTHHI) << 16) | hil_readbkp(HIL_BKP_LENGTHLO),
+				  ((uint32_t)hil_readbkp(HIL_BKP_CRCHI) << 16) | hil_readbkp(HIL_BKP_CRCLO));
+}
+
+/*
+ * @brief  Rebuilds the metadata state scanning the records of both pages. Records
+ *         whose tag is not written (torn by a reset) are skipped.
+ * @param  void
+ * @retval void
+ */
+void slot_load(void) {
+	uint32_t rec, tag;
+	slotrecord_t r;
+
+	slot_latest.slot = SLOT_NONE;
+	slot_fallback.slot = SLOT_NONE;
+	slot_next = SLOTMETAbase;
+
+	for (rec = SLOTMETAbase; rec < SLOTMETAbase + SLOTMETAPAGES*FLASHPAGESIZE; rec += SLOT_RECORDSIZE) {
+		tag = hil_readFLASH(rec + 12);
+		if ((tag & SLOT_TAG_MASK) != SLOT_TAG || (tag & 0xFF) > SLOT_B) continue;
+		r.slot = tag & 0xFF;
+		r.length = hil_readFLASH(rec);
+		r.crc = hil_readFLASH(rec + 4);
+		r.sequence = hil_readFLASH(rec + 8);
+		if (slot_latest.slot == SLOT_NONE || r.sequence > slot_latest.sequence) {
+			if (slot_latest.slot != SLOT_NONE && slot_latest.slot != r.slot) slot_fallback = slot_latest;
+			slot_latest = r;
+			slot_next = rec;
+		}
+		else if (r.slot != slot_latest.slot &&
+				 (slot_fallback.slot == SLOT_NONE || r.sequence > slot_fallback.sequence)) {
+			slot_fallback = r;
+		}
+	}
+
+	/* Append after the latest record, in its page. */
+	if (slot_latest.slot != SLOT_NONE) {
+		do slot_next += SLOT_RECORDSIZE;
+		while ((slot_next & (FLASHPAGESIZE-1)) != 0 &&
+			   (hil_readFLASH(slot_next) != SLOT_FREE || hil_readFLASH(slot_next + 12) != SLOT_FREE));
+	}
+}
+
+/*
+ * @brief  Checks the image of a record against its CRC-32
+ * @param  record
+ * @retval 1 if valid
+ * 		   0 if not
+ */
+int32_t slot_valid(slotrecord_t *r) {
+	if (r->length == 0 || r->length > SLOTSIZE || (r->length & 0x3) != 0) return 0;
+	return hil_crc32(slot_base(r->slot), r->length) == r->crc;
+}
+
+/*
+ * @brief  Checks the image of a record to boot, as slot_valid(), unless the record
+ *         was found valid at a previous boot (HIL_BKP_SLOTCACHE)
+ * @param  record
+ * @retval 1 if valid
+ * 		   0 if not
+ */
+int32_t slot_validboot(slotrecord_t *r) {
+	uint16_t key = slot_imagekey(slot_base(r->slot), r->length, r->crc);
+
+	if (hil_readbkp(HIL_BKP_SLOTCACHE) == key) return 1;
+	if (slot_valid(r) != 1) return 0;
+	hil_writebkp(HIL_BKP_SLOTCACHE, key);
+	return 1;
+}
+
+/*
+ * @brief  Appends a record, making it the latest one. A full page is not erased:
+ *         the other page is, and the fallback record is copied there first.
+ * @param  record, whose sequence number must be higher than the latest one
+ * @retval 0 if successful
+ * 		  -1 if not successful
+ */
+int32_t slot_append(slotrecord_t *r) {
+	slotrecord_t fallback = slot_fallback;
+	uint32_t page;
+
+	if (slot_latest.slot != SLOT_NONE && slot_latest.slot != r->slot) fallback = slot_latest;
+
+	/* No record yet: whatever torn records are there go. */
+	if (slot_latest.slot == SLOT_NONE) {
+		if (FLASH_ErasePage(SLOTMETAbase) != FLASH_COMPLETE) return -1;
+		slot_next = SLOTMETAbase;
+	}
+	else if ((slot_next & (FLASHPAGESIZE-1)) == 0) {
+		page = slot_next - FLASHPAGESIZE;
+		page = (page == SLOTMETAbase) ? SLOTMETAbase + FLASHPAGESIZE : SLOTMETAbase;
+		if (FLASH_ErasePage(page) != FLASH_COMPLETE) return -1;
+		slot_next = page;
+		if (fallback.slot != SLOT_NONE) {
+			if (slot_program(slot_next, &fallback) == -1) return -1;
+			slot_next += SLOT_RECORDSIZE;
+		}
+	}
+	if (slot_program(slot_next, r) == -1) return -1;
+	slot_next += SLOT_RECORDSIZE;
+	slot_fallback = fallback;
+	slot_latest = *r;
+	return 0;
+}
+
+/*
+ * @brief  Programs a record, the tag last
+ * @param  address, record
+ * @retval 0 if successful
+ * 		  -1 if not successful
+ */
+int32_t slot_program(uint32_t addr, slotrecord_t *r) {
+	if (FLASH_ProgramWord(addr, r->length) != FLASH_COMPLETE) return -1;
+	if (FLASH_ProgramWord(addr + 4, r->crc) != FLASH_COMPLETE) return -1;
+	if (FLASH_ProgramWord(addr + 8, r->sequence) != FLASH_COMPLETE) return -1;
+	if (FLASH_ProgramWord(addr + 12, SLOT_TAG | r->slot) != FLASH_COMPLETE) return -1;
+	return 0;
+}
+#endif
+
+/*
+ * @brief  Key of an image in HIL_BKP_IMAGECACHE or HIL_BKP_SLOTCACHE: its base,
+ *         length and CRC folded in 16 bits, never 0
+ * @param  image base address, length, CRC-32
+ * @retval key
+ */
+uint16_t slot_imagekey(uint32_t base, uint32_t length, uint32_t crc) {
+	uint32_t k = crc ^ length ^ (base >> 11);
+
+	k = (k ^ (k >> 16)) & 0xFFFF;
+	return (k == 0) ? 1 : k;
+}
+
+/**
+  * @}
+  */
+
+/**************************** Politecnico di Milano ************END OF FILE****/
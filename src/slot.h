@@ -0,0 +1,104 @@
+/**
+  ******************************************************************************
+  * @file    CBBL_usart/src/slot.h
+  * @author  Marco Zavatta, Yin Zhining
+  * @version V1.0
+  * @date    03/04/2012
+  * @brief   Application slots
+  ******************************************************************************
+  */
+
+#include "includes.h"
+#include "hil.h"
+#include "image.h"
+
+#ifndef SLOT_H
+#define SLOT_H
+
+/*
+ * With DUALSLOT (see hil.h) the application area holds two slots, A and B, each
+ * image being linked for the slot it is written to. The host writes the new
+ * image to the inactive slot and activates it with its length and CRC-32: once
+ * validated, a single record appended to the metadata pages makes it the active
+ * slot. Records are four words, the tag written last, and the latest one is the
+ * one with the highest sequence number.
+ *
+ * Every boot of the active slot increments HIL_BKP_BOOTCOUNT, which the
+ * application clears once it is up; past SLOT_MAXTRIES boots, or if its CRC no
+ * longer matches, the previously active slot is activated back. If that one does
+ * not match its record either, nothing is booted and the bootloader keeps
+ * serving the host.
+ * Without DUALSLOT the only slot is the application area at FLASHbase.
+ *
+ * Whatever the slot, its vector table is sanity-checked and its image header
+ * (see image.h) is checked before booting: an erased slot, a vector table not
+ * pointing into the RAM and the slot or an image not matching its header is
+ * never booted. The key of the last image found valid is kept in
+ * HIL_BKP_IMAGECACHE, and under DUALSLOT that of the last slot record found
+ * valid in HIL_BKP_SLOTCACHE, so that the CRCs are only computed again once
+ * the image changed: any session claiming the FLASH (see command_claimflash())
+ * clears both.
+ *
+ * Built into the update agent (CBBL_AGENT), slot_activate() only validates the
+ * image and leaves the request in the backup registers: the bootloader verifies
+ * it again and activates it at the next boot.
+ */
+
+#define SLOT_A					(0)
+#define SLOT_B					(1)
+#define SLOT_NONE				(0xFF)
+#define SLOT_MAXTRIES			(3)
+
+/* slot_boot(): neither slot holds an image matching its record. */
+#define SLOT_NOBOOT				(0xFFFFFFFF)
+
+/* HIL_BKP_REQUEST: activation requested by the update agent, | slot. */
+#define SLOT_REQUEST			(0xA500)
+#define SLOT_REQUEST_MASK		(0xFF00)
+
+/* Largest image, see slot_checkimage(). */
+#ifdef DUALSLOT
+#define SLOT_IMAGESIZE			(SLOTSIZE)
+#else
+#define SLOT_IMAGESIZE			(FLASHtop - FLASHbase + 1)
+#endif
+
+/* Image check, see slot_checkimage(); only images >= SLOT_IMAGE_NONE are booted. */
+#define SLOT_IMAGE_ERASED		(-2)	/* nothing there */
+#define SLOT_IMAGE_BAD			(-1)	/* vector table not sane, or header found and image not matching it */
+#define SLOT_IMAGE_NONE			(0)		/* no header, sane vector table */
+#define SLOT_IMAGE_VALID		(1)		/* header found, image matching it */
+
+/* Metadata record: length, CRC-32, sequence number, tag | slot. */
+#define SLOT_TAG				(0x534C0000)
+#define SLOT_TAG_MASK			(0xFFFF0000)
+#define SLOT_RECORDSIZE			(16)
+#define SLOT_FREE				(0xFFFFFFFF)
+
+typedef struct {
+	uint8_t slot;					/* SLOT_A, SLOT_B, SLOT_NONE if no record */
+	uint32_t length;				/* image length in bytes */
+	uint32_t crc;					/* image CRC-32, see hil_crc32() */
+	uint32_t sequence;				/* activation number */
+} slotrecord_t;
+
+/* Exported functions ------------------------------------------------------- */
+uint32_t slot_boot(void);
+int32_t slot_activate(uint8_t slot, uint32_t length, uint32_t crc);
+uint8_t slot_active(void);
+uint32_t slot_base(uint8_t slot);
+uint32_t slot_inactivebase(void);
+int32_t slot_checkimage(uint32_t base);
+const imageheader_t *slot_header(uint32_t base);
+void slot_forgetimage(void);
+
+/* Function prototypes ------------------------------------------------------ */
+void slot_load(void);
+void slot_takerequest(void);
+int32_t slot_valid(slotrecord_t *r);
+int32_t slot_validboot(slotrecord_t *r);
+int32_t slot_append(slotrecord_t *r);
+int32_t slot_program(uint32_t addr, slotrecord_t *r);
+uint16_t slot_imagekey(uint32_t base, uint32_t length, uint32_t crc);
+
+#endif /* SLOT_H */
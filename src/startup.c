@@ -13,6 +13,7 @@ extern unsigned long _estack;
 
 void Reset_Handler(void) __attribute__((__interrupt__));
 void __Init_Data(void);
+void hil_cyclesinit(void);
 void Default_Handler(void);
 
 extern int main(void);
@@ -94,7 +95,7 @@ void WEAK DMA2_Channel4_5_IRQHandler(void);
  * .isr_vectors will be present in the object file before linking and will be placed
  * at the point specified by SECTIONS script in the linker file
  * _estack such defined in the linker script:
- * _estack = ORIGIN(RAM)+LENGTH(RAM); *end of the stack*
+ * _estack = 0x20002400; *end of the stack, RAMbase in hil.h*
  */
 
 __attribute__ ((section(".isr_vectors")))
@@ -205,6 +206,8 @@ void __Init_Data(void) {
 }
 
 void Reset_Handler(void) {
+	/* Start counting cycles first thing, for the boot time. */
+	hil_cyclesinit();
 	/* Initialize data and bss */
 	__Init_Data();
 	extern uint32_t _isr_vectors_offs;
@@ -21,6 +21,7 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f10x_it.h"
+#include "commands.h"
 
 /** @addtogroup CBBL
   * @{
@@ -140,6 +141,7 @@ void PendSV_Handler(void)
   */
 void SysTick_Handler(void)
 {
+	hil_tick();
 }
 
 /******************************************************************************/
@@ -149,6 +151,28 @@ void SysTick_Handler(void)
 /*  file (startup_stm32f10x_xx.s).                                            */
 /******************************************************************************/
 
+/**
+  * @brief  This function handles USART1 interrupt request: received bytes
+  *         are fed to the USART session.
+  * @param  None
+  * @retval None
+  */
+void USART1_IRQHandler(void)
+{
+  command_rxisr(CAL_USART);
+}
+
+/**
+  * @brief  This function handles CAN1 RX0 interrupt request: received frames
+  *         are fed to the CAN session.
+  * @param  None
+  * @retval None
+  */
+void USB_LP_CAN1_RX0_IRQHandler(void)
+{
+  command_rxisr(CAL_CAN);
+}
+
 /**
   * @brief  This function handles PPP interrupt request.
   * @param  None